@@ -32,6 +32,7 @@
 #include <sys/ioctl.h>
 
 #include "lunix.h"
+#include "lunix-ldisc.h"
 
 #ifndef _PATH_LOCKD
 #define _PATH_LOCKD		"/var/lock"		/* lock files   */
@@ -40,6 +41,9 @@
 #define _UID_UUCP		"uucp"			/* owns locks   */
 #endif
 
+/* How often to check that the lines are still ours, in seconds */
+#define LUNIX_ATTACH_CHECK_INTERVAL	5
+
 struct {
 	const char *speed;
 	int code;
@@ -67,13 +71,27 @@ struct {
   { NULL,	0	}
 };
 
+/*
+ * A TTY line the Lunix line discipline has been set on
+ */
+struct lunix_line {
+	const char *name;
+	int fd;
+	struct termios tty_before, tty_current;
+	int ldisc_before;
+	int attached;		/* The Lunix line discipline has been set */
+
+	int saved_lock;
+	char saved_path[PATH_MAX];
+};
+
 /*
  * Global data
  *
  */
-int tty_fd = -1;
-struct termios tty_before, tty_current;
-int ldisc_before;
+struct lunix_line *lines;
+int nr_lines;
+volatile sig_atomic_t show_stats;
 
 /* Check for an existing lock file on our device */
 static int tty_already_locked(char *nam)
@@ -105,26 +123,25 @@ static int tty_already_locked(char *nam)
 }
 
 /* Lock or unlock a terminal line. */
-static int tty_lock(char *path, int mode)
+static int tty_lock(struct lunix_line *line, const char *path, int mode)
 {
 	int fd;
 	int ret;
 	char apid[16];
 	struct passwd *pw;
-	static int saved_lock = 0;
-	static char saved_path[PATH_MAX];
 
 	/* We do not lock standard input. */
 	if (mode == 1) {	/* lock */
-		sprintf(saved_path, "%s/LCK..%s", _PATH_LOCKD, path);
-		if (tty_already_locked(saved_path)) {
+		snprintf(line->saved_path, sizeof(line->saved_path),
+			"%s/LCK..%s", _PATH_LOCKD, path);
+		if (tty_already_locked(line->saved_path)) {
 			fprintf(stderr, "/dev/%s already locked\n", path);
 			return -1;
 		}
-		if ((fd = creat(saved_path, 0644)) < 0) {
+		if ((fd = creat(line->saved_path, 0644)) < 0) {
 			if (errno != EEXIST) {
 				fprintf(stderr, "tty_lock: (%s): %s\n",
-						saved_path, strerror(errno));
+						line->saved_path, strerror(errno));
 			}
 			return -1;
 		}
@@ -132,7 +149,7 @@ static int tty_lock(char *path, int mode)
 		if ((ret = write(fd, apid, strlen(apid))) != strlen(apid)) {
 			fprintf(stderr, "write to PID file incomplete, ret = %d\n", ret);
 			close(fd);
-			unlink(saved_path);
+			unlink(line->saved_path);
 			return -1;
 		}
 		(void) close(fd);
@@ -142,22 +159,21 @@ static int tty_lock(char *path, int mode)
 			fprintf(stderr, "tty_lock: UUCP user %s unknown\n", _UID_UUCP);
 			return 0;
 		}
-		(void) chown(saved_path, pw->pw_uid, pw->pw_gid);
-		saved_lock = 1;
+		(void) chown(line->saved_path, pw->pw_uid, pw->pw_gid);
+		line->saved_lock = 1;
 	} else {	/* unlock */
-		if (saved_lock != 1)
+		if (line->saved_lock != 1)
 			return 0;
-		if (unlink(saved_path) < 0) {
+		if (unlink(line->saved_path) < 0) {
 			fprintf(stderr, "tty_unlock: (%s): %s\n",
-				saved_path, strerror(errno));
+				line->saved_path, strerror(errno));
 			return -1;
 		}
-		saved_lock = 0;
+		line->saved_lock = 0;
 	}
 	
 	return 0;
 }
-
 /* Find a serial speed code in the table. */
 static int tty_find_speed(const char *speed)
 {
@@ -281,11 +297,11 @@ static int tty_set_raw(struct termios *tty)
 
 
 /* Fetch the state of a terminal. */
-static int tty_get_state(struct termios *tty)
+static int tty_get_state(struct lunix_line *line, struct termios *tty)
 {
 	int saved_errno;
 
-	if (ioctl(tty_fd, TCGETS, tty) < 0) {
+	if (ioctl(line->fd, TCGETS, tty) < 0) {
 		saved_errno = errno;
 		perror("Get TTY State:");
 		return -saved_errno;
@@ -295,11 +311,11 @@ static int tty_get_state(struct termios *tty)
 }
 
 /* Set the state of a terminal. */
-static int tty_set_state(struct termios *tty)
+static int tty_set_state(struct lunix_line *line, struct termios *tty)
 {
 	int saved_errno;
 
-	if (ioctl(tty_fd, TCSETS, tty) < 0) {
+	if (ioctl(line->fd, TCSETS, tty) < 0) {
 		saved_errno = errno;
 		perror("Set TTY State:");
 		return -saved_errno;
@@ -309,11 +325,11 @@ static int tty_set_state(struct termios *tty)
 }
 
 /* Get the TTY line discipline. */
-static int tty_get_ldisc(int *disc)
+static int tty_get_ldisc(struct lunix_line *line, int *disc)
 {
 	int saved_errno;
 
-	if (ioctl(tty_fd, TIOCGETD, disc) < 0) {
+	if (ioctl(line->fd, TIOCGETD, disc) < 0) {
 		saved_errno = errno;
 		perror("get ldisc: failed to get line discipline");
 		fprintf(stderr, "Is the Lunix:TNG discipline actually loaded?!\n");
@@ -324,11 +340,11 @@ static int tty_get_ldisc(int *disc)
 }
 
 /* Set the TTY line discipline. */
-static int tty_set_ldisc(int disc)
+static int tty_set_ldisc(struct lunix_line *line, int disc)
 {
 	int saved_errno;
 
-	if (ioctl(tty_fd, TIOCSETD, &disc) < 0) {
+	if (ioctl(line->fd, TIOCSETD, &disc) < 0) {
 		saved_errno = errno;
 		perror("set ldisc: failed to set line discipline");
 		return -saved_errno;
@@ -338,14 +354,14 @@ static int tty_set_ldisc(int disc)
 }
 
 /* Restore the TTY to its previous state. */
-static int tty_restore(void)
+static int tty_restore(struct lunix_line *line)
 {
 	int ret;
 	struct termios tty;
 
-	tty = tty_before;
+	tty = line->tty_before;
   	(void) tty_set_speed(&tty, "0");
-	if ((ret = tty_set_state(&tty)) < 0) {
+	if ((ret = tty_set_state(line, &tty)) < 0) {
 		fprintf(stderr, "slattach: tty_restore: %s\n",
 			strerror(-ret));
 		return ret;
@@ -355,27 +371,37 @@ static int tty_restore(void)
 }
 
 /* Close down a terminal line. */
-static int tty_close(void)
+static int tty_close(struct lunix_line *line)
 {
+	if (line->fd < 0)
+		return 0;
+
 	/*
 	 * Set the old discipline and restore the
 	 * previous line mode.
 	 */
-	(void) tty_set_ldisc(ldisc_before);
-	(void) tty_restore();
-	(void) tty_lock(NULL, 0);
+	if (line->attached) {
+		(void) tty_set_ldisc(line, line->ldisc_before);
+		(void) tty_restore(line);
+		line->attached = 0;
+	}
+	(void) tty_lock(line, NULL, 0);
+	if (line->fd > 0)
+		(void) close(line->fd);
+	line->fd = -1;
 
 	return 0;
 }
 
 /* Open and initialize a terminal line. */
-static int tty_open(char *name)
+static int tty_open(struct lunix_line *line)
 {
 	int fd;
 	int ret;
 	int saved_errno;
 	char pathbuf[PATH_MAX];
-	register char *path_open, *path_lock;
+	const char *name = line->name;
+	register const char *path_open, *path_lock;
 
 	/* Try opening the TTY device. */
 	if (name != NULL) {
@@ -396,7 +422,7 @@ static int tty_open(char *name)
 		}
 	
 		fprintf(stderr, "tty_open: looking for lock\n");
-		if (tty_lock(path_lock, 1))
+		if (tty_lock(line, path_lock, 1))
 			return -1 ; /* can we lock the device? */
 		fprintf(stderr, "tty_open: trying to open %s\n",
 			path_open);
@@ -406,29 +432,29 @@ static int tty_open(char *name)
 				path_open, strerror(errno));
 			return -saved_errno;
 		}
-		tty_fd = fd;
+		line->fd = fd;
 		fprintf(stderr, "tty_open: %s (fd=%d) ", path_open, fd);
   	} else {
-		tty_fd = 0;
+		line->fd = 0;
 	}
 
 	/* Fetch the current state of the terminal. */
-	if (tty_get_state(&tty_before) < 0) {
+	if (tty_get_state(line, &line->tty_before) < 0) {
 		saved_errno = errno;
 		fprintf(stderr, "tty_open: cannot get current state\n");
 		return -saved_errno;
 	}
-	tty_current = tty_before;
+	line->tty_current = line->tty_before;
 	
 	/* Fetch the current line discipline of this terminal. */
-	if (tty_get_ldisc(&ldisc_before) < 0) {
+	if (tty_get_ldisc(line, &line->ldisc_before) < 0) {
 		saved_errno = errno;
 		fprintf(stderr, "tty_open: cannot get current line disc\n");
 		return -saved_errno;
 	}
 
 	/* Put this terminal line in a 8-bit transparent mode. */
-	if (tty_set_raw(&tty_current) < 0) {
+	if (tty_set_raw(&line->tty_current) < 0) {
 		saved_errno = errno;
 		fprintf(stderr, "tty_open: cannot set RAW mode\n");
 		return -saved_errno;
@@ -439,61 +465,157 @@ static int tty_open(char *name)
 	 * 57600bps, 8 data bits, No parity, 1 stop bit:
 	 **************************************************
 	 */
-	if (tty_set_speed(&tty_current, "57600") != 0) {
+	if (tty_set_speed(&line->tty_current, "57600") != 0) {
 			saved_errno = errno;
 			fprintf(stderr, "tty_open: cannot set data rate to 57600bps\n");
 			return -saved_errno;
 	}
-	if (tty_set_databits(&tty_current, "8") ||
-	    tty_set_stopbits(&tty_current, "1") ||
-	    tty_set_parity(&tty_current, "N")) {
+	if (tty_set_databits(&line->tty_current, "8") ||
+	    tty_set_stopbits(&line->tty_current, "1") ||
+	    tty_set_parity(&line->tty_current, "N")) {
 	    	saved_errno = errno;
 		fprintf(stderr, "tty_open: cannot set 8N1 mode\n");
 		return -saved_errno;
   	};
 
 	/* Set the new line mode. */
-	if ((ret = tty_set_state(&tty_current)) < 0)
+	if ((ret = tty_set_state(line, &line->tty_current)) < 0)
 		return ret;
 
 	/* And activate the new line discipline */
-	if ((ret = tty_set_ldisc(N_LUNIX_LDISC)) < 0)
+	if ((ret = tty_set_ldisc(line, N_LUNIX_LDISC)) < 0)
 		return ret;
+	line->attached = 1;
 		
 	return 0;
 }
 
+/* Close down all terminal lines. */
+static void tty_close_all(void)
+{
+	int i;
+
+	for (i = 0; i < nr_lines; i++)
+		tty_close(&lines[i]);
+}
+
+/*
+ * Check that a line still has the Lunix line discipline set on it.
+ * If not, someone else has taken over the TTY, or it has gone away.
+ */
+static int tty_check(struct lunix_line *line)
+{
+	int disc;
+
+	if (ioctl(line->fd, TIOCGETD, &disc) < 0) {
+		fprintf(stderr, "%s: cannot get line discipline: %s\n",
+			line->name, strerror(errno));
+		return -1;
+	}
+	if (disc != N_LUNIX_LDISC) {
+		fprintf(stderr, "%s: line discipline changed to %d\n",
+			line->name, disc);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Print the statistics the line discipline keeps for a line. */
+static void tty_show_stats(struct lunix_line *line)
+{
+	struct lunix_ldisc_stats_struct stats;
+
+	if (ioctl(line->fd, LUNIX_LDISC_IOC_STATS, &stats) < 0) {
+		fprintf(stderr, "%s: cannot get statistics: %s\n",
+			line->name, strerror(errno));
+		return;
+	}
+	fprintf(stderr, "%s: %" PRIu64 " packets, %" PRIu64 " bad CRCs, "
+		"%" PRIu64 " resyncs (%" PRIu64 " bytes discarded), "
+		"%" PRIu64 " duplicates\n",
+		line->name, stats.packets, stats.crc_errors,
+		stats.resyncs, stats.discarded, stats.duplicates);
+	fprintf(stderr, "%s: %" PRIu64 " characters queued, throttled %" PRIu64
+		" times (%" PRIu64 " characters), %" PRIu64 " dropped\n",
+		line->name, stats.queued, stats.throttle_cnt,
+		stats.throttled, stats.dropped);
+}
+
 /* Catch any signals. */
 static void sig_catch(int sig)
 {
-	tty_close();
+	tty_close_all();
 	exit(0);
 }
 
+/* Statistics are printed on SIGUSR1. */
+static void sig_stats(int sig)
+{
+	show_stats = 1;
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
+	int i;
+	int active;
+
+	if (argc < 2) {
 		fprintf(stderr,
-			"Usage: %s tty_line\n"
-			"where tty_line is the TTY on which to set the Lunix line discipline.\n\n",
+			"Usage: %s tty_line [tty_line ...]\n"
+			"where tty_line is a TTY on which to set the Lunix line discipline.\n\n",
 			argv[0]);
 		exit(1);
 	}
-	
-	if (tty_open(argv[1]) < 0)
-		return 1;
-	
-	fprintf(stderr, "Line discipline set on %s, press ^C to release the TTY...\n",
-		argv[1]);
-	
+
+	nr_lines = argc - 1;
+	if ((lines = calloc(nr_lines, sizeof(*lines))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < nr_lines; i++) {
+		lines[i].name = argv[i + 1];
+		lines[i].fd = -1;
+	}
+
   	(void) signal(SIGHUP, sig_catch);
   	(void) signal(SIGINT, sig_catch);
   	(void) signal(SIGQUIT, sig_catch);
   	(void) signal(SIGTERM, sig_catch);
-	
-	while (pause())
-		;
+  	(void) signal(SIGUSR1, sig_stats);
+
+	for (i = 0; i < nr_lines; i++) {
+		if (tty_open(&lines[i]) < 0) {
+			tty_close_all();
+			return 1;
+		}
+		fprintf(stderr, "Line discipline set on %s\n", lines[i].name);
+	}
+	fprintf(stderr, "%d line(s) attached, press ^C to release the TTYs, "
+		"send SIGUSR1 for statistics...\n", nr_lines);
+
+	/*
+	 * Supervise the lines: release any line which
+	 * has been taken away from us, and give up
+	 * once none is left.
+	 */
+	do {
+		sleep(LUNIX_ATTACH_CHECK_INTERVAL);
+		for (i = active = 0; i < nr_lines; i++) {
+			if (lines[i].fd < 0)
+				continue;
+			if (tty_check(&lines[i]) < 0) {
+				tty_close(&lines[i]);
+				fprintf(stderr, "Released %s\n", lines[i].name);
+				continue;
+			}
+			if (show_stats)
+				tty_show_stats(&lines[i]);
+			active++;
+		}
+		show_stats = 0;
+	} while (active > 0);
 
-	/* Unreachable */
-	return 100;
+	fprintf(stderr, "No lines left, exiting\n");
+	return 1;
 }
@@ -13,11 +13,17 @@
 #include <linux/init.h>
 #include <linux/list.h>
 #include <linux/cdev.h>
+#include <linux/llist.h>
+#include <linux/mutex.h>
+#include <linux/device.h>
+#include <linux/workqueue.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
@@ -26,29 +32,130 @@
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
-#include "lunix-lookup.h"
 
 /*
  * Global data
  */
 struct cdev lunix_chrdev_cdev;
+static dev_t lunix_chrdev_dev_no;
 
-struct lunix_chrdev_state_struct *lunix_states;
+/*
+ * Device nodes. Sensors get theirs [lunix<NO>-<TYPE>] when they are
+ * created, which may happen in atomic context, so new sensors are
+ * queued for a work item to create their class devices.
+ */
+static const char * const lunix_chrdev_msr_names[N_LUNIX_MSR] = {
+	"batt", "temp", "light"
+};
+static struct class *lunix_chrdev_class;
+static LLIST_HEAD(lunix_chrdev_new_sensors);
+static DEFINE_MUTEX(lunix_chrdev_devices_lock);
 
 /*
- * Just a quick [unlocked] check to see if the cached
- * chrdev state needs to be updated from sensor measurements.
+ * Whether a raw measurement moved past the deadband around
+ * the last value reported, if one has been set.
  */
-static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *state)
+static int lunix_chrdev_state_past_deadband(struct lunix_chrdev_state_struct *state,
+	uint32_t data)
+{
+	int64_t delta;
+	int64_t last = state->buf_value;
+	int64_t threshold = READ_ONCE(state->deadband);
+
+	if (state->buf_seq == 0)
+		return 1;
+
+	delta = abs(lunix_sensor_cook(state->type, data) - last);
+	switch (READ_ONCE(state->deadband_mode)) {
+	case LUNIX_DEADBAND_ABS:
+		return delta >= threshold;
+	case LUNIX_DEADBAND_REL:
+		return delta * 1000 >= abs(last) * threshold;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Whether there is a measurement this open file would report
+ */
+static int lunix_chrdev_state_has_news(struct lunix_chrdev_state_struct *state)
 {
 	struct lunix_sensor_struct *sensor;
 	
+	uint64_t seq;
+
 	WARN_ON ( !(sensor = state->sensor));
-	if (state->buf_timestamp == sensor->msr_data[state->type]->last_update)
+	seq = READ_ONCE(sensor->seq);
+	if (state->buf_seq == seq)
+		return 0;
+	if (state->exclusive &&
+	    atomic64_read(&sensor->claimed[state->type]) >= seq)
+		return 0;
+	if (!lunix_chrdev_state_past_deadband(state,
+			READ_ONCE(sensor->values[state->type])))
 		return 0;
 	return 1; /* ? */
 }
 
+/*
+ * Whether the minimum interval since the last measurement
+ * reported is not over yet, see LUNIX_IOC_INTERVAL
+ */
+static int lunix_chrdev_state_coalescing(struct lunix_chrdev_state_struct *state)
+{
+	ktime_t next = READ_ONCE(state->next_delivery);
+
+	return next && ktime_before(ktime_get(), next);
+}
+
+/*
+ * Just a quick [unlocked] check to see if the cached
+ * chrdev state needs to be updated from sensor measurements.
+ */
+static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *state)
+{
+	return lunix_chrdev_state_has_news(state) &&
+	       !lunix_chrdev_state_coalescing(state);
+}
+
+/*
+ * Claims an update for an exclusive reader.
+ * Returns 0 if another exclusive reader got to it first.
+ */
+static int lunix_chrdev_state_claim(struct lunix_chrdev_state_struct *state,
+	uint64_t seq)
+{
+	atomic64_t *claimed = &state->sensor->claimed[state->type];
+	long long old;
+
+	do {
+		old = atomic64_read(claimed);
+		if (old >= seq)
+			return 0;
+	} while (atomic64_cmpxchg(claimed, old, seq) != old);
+
+	return 1;
+}
+
+/*
+ * Moves an exclusive open file which just claimed an update to the
+ * tail of the wait queue of the sensor, handing the next update off
+ * to the next one in line. This is done here, and not when the open
+ * file is woken up, since the wakeup must not reorder the very queue
+ * it is walking.
+ */
+static void lunix_chrdev_state_rotate(struct lunix_chrdev_state_struct *state)
+{
+	unsigned long flags;
+	wait_queue_head_t *wq = &state->sensor->wq[state->type];
+
+	spin_lock_irqsave(&wq->lock, flags);
+	if (state->wait.flags & WQ_FLAG_EXCLUSIVE)
+		list_move_tail(&state->wait.entry, &wq->head);
+	spin_unlock_irqrestore(&wq->lock, flags);
+}
+
 /*
  * Updates the cached state of a character device
  * based on sensor data. Must be called with the
@@ -61,20 +168,38 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 	if (!lunix_chrdev_state_needs_refresh(state))
 		return -EAGAIN;
 		
+	unsigned int start;
+	uint64_t seq, timestamp;
 	uint32_t data;
 
 	/*
-	 * Grab the raw data quickly, hold the
-	 * spinlock for as little as possible.
+	 * Grab the raw data quickly. The sensor seqlock is
+	 * only read, so any number of readers can do this at once;
+	 * just retry if the line discipline updated the sensor meanwhile.
 	 */
-	/* ? */
-	/* Why use spinlocks? See LDD3, p. 119 */
-	debug("Spinlock on\n");
-	spin_lock(&sensor->lock);
-	state->buf_timestamp = sensor->msr_data[state->type]->last_update;
-	data = sensor->msr_data[state->type]->values[0];
-	spin_unlock(&sensor->lock);
-	debug("Spinlock off\n");
+	do {
+		start = read_seqbegin(&sensor->lock);
+		seq = sensor->seq;
+		timestamp = sensor->last_update;
+		data = sensor->values[state->type];
+	} while (read_seqretry(&sensor->lock, start));
+
+	/*
+	 * Changes within the deadband are not worth reporting.
+	 * Exclusive readers share updates, only the
+	 * one who claims an update gets to report it.
+	 */
+	if (!lunix_chrdev_state_past_deadband(state, data))
+		return -EAGAIN;
+	if (state->exclusive) {
+		if (!lunix_chrdev_state_claim(state, seq))
+			return -EAGAIN;
+		lunix_chrdev_state_rotate(state);
+	}
+	state->buf_seq = seq;
+	if (state->min_interval)
+		WRITE_ONCE(state->next_delivery,
+			ktime_add(ktime_get(), state->min_interval));
 	
 	/*
 	 * Any new data available?
@@ -85,57 +210,254 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 	 * Now we can take our time to format them,
 	 * holding only the private state semaphore
 	 */
-	long looked_up;
-	/* ? */
-	switch (state->type) {
-		case BATT: looked_up = lookup_voltage[data]; break;
-		case TEMP: looked_up = lookup_temperature[data]; break;
-		case LIGHT: looked_up = lookup_light[data]; break;
-	}
-	int int_part = looked_up / 1000;
-	int dec_part = looked_up % 1000;
+	long looked_up = lunix_sensor_cook(state->type, data);
+	state->buf_value = looked_up;
+
+	if (state->binary) {
+		struct lunix_msr_sample_struct rec = {
+			.seq = seq,
+			.timestamp = timestamp,
+			.value = data,
+			.cooked = looked_up,
+		};
 
-	state->buf_lim = snprintf(state->buf_data, LUNIX_CHRDEV_BUFSZ, "%d.%d\n", int_part, dec_part);
+		memcpy(state->buf_data, &rec, sizeof(rec));
+		state->buf_lim = sizeof(rec);
+	} else {
+		long abs_value = abs(looked_up);
+
+		state->buf_lim = snprintf(state->buf_data, LUNIX_CHRDEV_BUFSZ, "%s%ld.%03ld\n",
+			looked_up < 0 ? "-" : "", abs_value / 1000, abs_value % 1000);
+	}
 
 	debug("leaving\n");
 	return 0;
 }
 
+/*
+ * Called by the sensor when it is updated, with the lock of its
+ * wait queue held. Wakes up the readers of this open file if they
+ * are interested in the update. Exclusive open files report if they
+ * woke anyone up, so the sensor stops at the first one which did.
+ * The queue is left alone here; the reader which claims the update
+ * moves its open file to the tail afterwards.
+ */
+static int lunix_chrdev_wake(wait_queue_entry_t *wait, unsigned int mode,
+	int sync, void *key)
+{
+	struct lunix_chrdev_state_struct *state =
+		container_of(wait, struct lunix_chrdev_state_struct, wait);
+
+	if (!lunix_chrdev_state_has_news(state))
+		return 0;
+
+	/*
+	 * Updates within the minimum interval are coalesced,
+	 * the latest one is reported once it is over.
+	 */
+	if (lunix_chrdev_state_coalescing(state)) {
+		if (!hrtimer_is_queued(&state->timer))
+			hrtimer_start(&state->timer, READ_ONCE(state->next_delivery),
+				HRTIMER_MODE_ABS);
+		return 0;
+	}
+
+	if (!(wait->flags & WQ_FLAG_EXCLUSIVE)) {
+		wake_up_interruptible(&state->wq);
+		return 0;
+	}
+
+	if (!wq_has_sleeper(&state->wq))
+		return 0;
+	wake_up_interruptible(&state->wq);
+	return 1;
+}
+
+/*
+ * The minimum interval is over, time to report the latest update
+ */
+static enum hrtimer_restart lunix_chrdev_timer(struct hrtimer *timer)
+{
+	struct lunix_chrdev_state_struct *state =
+		container_of(timer, struct lunix_chrdev_state_struct, timer);
+
+	wake_up_interruptible(&state->wq);
+	return HRTIMER_NORESTART;
+}
+
 /*************************************
  * Implementation of file operations
  * for the Lunix character device
  *************************************/
 
+/*
+ * Fills in the entries of a sensor for the snapshot device, from a
+ * single update. Returns 0 if the sensor has not been heard from yet.
+ */
+static int lunix_chrdev_snapshot_sensor(struct lunix_sensor_struct *sensor,
+	struct lunix_snapshot_entry_struct *e)
+{
+	int i;
+	unsigned int start;
+	uint64_t seq, timestamp;
+	uint32_t values[N_LUNIX_MSR];
+
+	do {
+		start = read_seqbegin(&sensor->lock);
+		seq = sensor->seq;
+		timestamp = sensor->last_update;
+		memcpy(values, sensor->values, sizeof(values));
+	} while (read_seqretry(&sensor->lock, start));
+
+	if (seq == 0)
+		return 0;
+
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		e[i].seq = seq;
+		e[i].timestamp = timestamp;
+		e[i].nodeid = sensor->nodeid;
+		e[i].type = i;
+		e[i].value = values[i];
+		e[i].cooked = lunix_sensor_cook(i, values[i]);
+		e[i].__pad = 0;
+	}
+	return 1;
+}
+
+/*
+ * Returns the latest measurements of as many sensors as fit in the
+ * buffer, walking the sensors in batches. A snapshot is only taken
+ * by reads at offset 0, and advances the file position past it, so
+ * that further reads see end of file. Use pread() at offset 0, or
+ * seek back to it, for each fresh snapshot.
+ */
+static ssize_t lunix_chrdev_snapshot_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t ret;
+	size_t done, len, copied;
+	unsigned int i, n, room;
+	unsigned long nodeid;
+	struct lunix_snapshot_entry_struct *entries, *e;
+	struct lunix_sensor_struct *batch[LUNIX_CHRDEV_SNAPSHOT_BATCH];
+	size_t cnt = iov_iter_count(to);
+
+	if (iocb->ki_pos > 0)
+		return 0;
+
+	room = min_t(size_t, cnt / (sizeof(*entries) * N_LUNIX_MSR), LUNIX_SENSOR_MAX);
+	if (room == 0)
+		return -EINVAL;
+
+	entries = kmalloc(sizeof(*entries) * N_LUNIX_MSR * ARRAY_SIZE(batch), GFP_KERNEL);
+	if (!entries)
+		return -ENOMEM;
+
+	done = 0;
+	nodeid = 0;
+	while (room > 0 && nodeid <= LUNIX_SENSOR_MAX) {
+		n = lunix_sensors_lookup(batch, nodeid,
+			min_t(unsigned int, room, ARRAY_SIZE(batch)));
+		if (n == 0)
+			break;
+		nodeid = batch[n - 1]->nodeid + 1;
+
+		e = entries;
+		for (i = 0; i < n; i++) {
+			if (lunix_chrdev_snapshot_sensor(batch[i], e)) {
+				e += N_LUNIX_MSR;
+				room--;
+			}
+		}
+
+		len = (e - entries) * sizeof(*e);
+		copied = copy_to_iter(entries, len, to);
+		done += copied;
+		if (copied != len) {
+			/* Only fail if nothing made it to userspace */
+			ret = done ? done : -EFAULT;
+			goto out;
+		}
+	}
+	ret = done;
+out:
+	iocb->ki_pos += done;
+	kfree(entries);
+	return ret;
+}
+
+static struct file_operations lunix_chrdev_snapshot_fops = 
+{
+	.owner          = THIS_MODULE,
+	.read_iter      = lunix_chrdev_snapshot_read_iter,
+	.splice_read    = generic_file_splice_read,
+	.llseek         = default_llseek,
+};
+
 static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 {
 	/* Declarations */
 	int minor = iminor(inode);
-	int type = minor & 7;
-	int sensor_index = (minor - type) >> 3;
-
-	struct lunix_chrdev_state_struct *dev = (struct lunix_chrdev_state_struct*) kmalloc(sizeof(struct lunix_chrdev_state_struct), GFP_KERNEL);
-	dev->type = type;
-	dev->sensor = lunix_sensors + sensor_index;
-	dev->buf_lim = 1;
-	dev->buf_data[0] = '\0';
-	dev->buf_timestamp = 0;
-	sema_init(&dev->lock, 1);
+	int type = minor & 3;
+	int binary = minor & LUNIX_CHRDEV_BINARY;
+	int sensor_index = minor >> 3;
+	struct lunix_sensor_struct *sensor;
+	struct lunix_chrdev_state_struct *dev;
 
 	int ret;
 	
 	debug("entering\n");
-	ret = -ENODEV;
+	/* The snapshot device is positioned, so that it can report EOF */
+	if (minor == LUNIX_CHRDEV_SNAPSHOT_MINOR) {
+		replace_fops(filp, fops_get(&lunix_chrdev_snapshot_fops));
+		ret = 0;
+		goto out;
+	}
 	if ((ret = nonseekable_open(inode, filp)) < 0)
 		goto out;
+	ret = -ENODEV;
+	if (type >= N_LUNIX_MSR)
+		goto out;
 
-	filp->private_data = dev;
 	/*
 	 * Associate this open file with the relevant sensor based on
-	 * the minor number of the device node [/dev/sensor<NO>-<TYPE>]
+	 * the minor number of the device node [/dev/sensor<NO>-<TYPE>],
+	 * or [/dev/sensor<NO>-<TYPE>-bin] for binary records.
+	 * Sensor N reports as node id N + 1. Sensors are only created
+	 * by the protocol, as nodes are heard from, so that memory
+	 * follows the motes actually out there and not what gets opened.
 	 */
-	
+	ret = -ENODEV;
+	sensor = lunix_sensor_lookup(sensor_index + 1);
+	if (!sensor)
+		goto out;
+
 	/* Allocate a new Lunix character device private state structure */
-	/* ? */
+	ret = -ENOMEM;
+	dev = kmalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		goto out;
+	dev->type = type;
+	dev->sensor = sensor;
+	dev->buf_lim = 1;
+	dev->buf_data[0] = '\0';
+	dev->buf_seq = 0;
+	dev->buf_value = 0;
+	dev->exclusive = 0;
+	dev->binary = !!binary;
+	dev->deadband_mode = LUNIX_DEADBAND_NONE;
+	dev->deadband = 0;
+	dev->min_interval = 0;
+	dev->next_delivery = 0;
+	hrtimer_init(&dev->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	dev->timer.function = lunix_chrdev_timer;
+	sema_init(&dev->lock, 1);
+
+	init_waitqueue_head(&dev->wq);
+	init_waitqueue_func_entry(&dev->wait, lunix_chrdev_wake);
+	add_wait_queue(&sensor->wq[type], &dev->wait);
+
+	filp->private_data = dev;
+	ret = 0;
 out:
 	debug("leaving, with ret = %d\n", ret);
 	return ret;
@@ -143,37 +465,279 @@ out:
 
 static int lunix_chrdev_release(struct inode *inode, struct file *filp)
 {
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+
 	debug("Freeing_resources!\n");
-	kfree(filp->private_data);
+	remove_wait_queue(&state->sensor->wq[state->type], &state->wait);
+	hrtimer_cancel(&state->timer);
+	kfree(state);
+	return 0;
+}
+
+/*
+ * Copies the samples of a measurement newer than hist->since, oldest
+ * first, out of the history ring in the measurement page.
+ */
+static long lunix_chrdev_ioctl_history(struct lunix_chrdev_state_struct *state,
+	struct lunix_ioc_history_struct __user *uhist)
+{
+	long ret;
+	unsigned int start;
+	uint32_t i, n, head;
+	uint64_t seq, avail;
+	struct lunix_ioc_history_struct hist;
+	struct lunix_msr_sample_struct *samples;
+	struct lunix_sensor_struct *sensor = state->sensor;
+	struct lunix_msr_data_struct *msr = sensor->msr_data[state->type];
+
+	/* Compact sensors keep no history */
+	if (!msr)
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&hist, uhist, sizeof(hist)))
+		return -EFAULT;
+
+	samples = kmalloc(sizeof(*samples) * LUNIX_MSR_HISTORY, GFP_KERNEL);
+	if (!samples)
+		return -ENOMEM;
+
+	do {
+		start = read_seqbegin(&sensor->lock);
+		seq = msr->seq;
+		head = READ_ONCE(msr->head);
+		avail = (seq > hist.since) ? seq - hist.since : 0;
+		avail = min_t(uint64_t, avail, LUNIX_MSR_HISTORY);
+		n = min_t(uint64_t, avail, hist.count);
+		for (i = 0; i < n; i++)
+			samples[i] = msr->values[(head - (uint32_t)avail + 1 + i) & (LUNIX_MSR_HISTORY - 1)];
+	} while (read_seqretry(&sensor->lock, start));
+
+	ret = -EFAULT;
+	if (copy_to_user((void __user *)(uintptr_t)hist.samples, samples, sizeof(*samples) * n))
+		goto out;
+	if (put_user(n, &uhist->count))
+		goto out;
+	ret = 0;
+out:
+	kfree(samples);
+	return ret;
+}
+
+/*
+ * Summarizes the samples of a measurement received over the last
+ * stats->window_ms milliseconds, rounded up to whole buckets.
+ */
+static long lunix_chrdev_ioctl_stats(struct lunix_chrdev_state_struct *state,
+	struct lunix_ioc_stats_struct __user *ustats)
+{
+	int i;
+	int64_t sum;
+	unsigned int start;
+	uint64_t epoch, nr;
+	struct lunix_ioc_stats_struct st;
+	struct lunix_stats_bucket_struct *b;
+	struct lunix_sensor_struct *sensor = state->sensor;
+	struct lunix_sensor_stats_struct *stats = sensor->stats;
+	int type = state->type;
+
+	if (copy_from_user(&st, ustats, sizeof(st)))
+		return -EFAULT;
+
+	nr = st.window_ms ? DIV_ROUND_UP(st.window_ms, lunix_stats_bucket_ms) : LUNIX_STATS_BUCKETS;
+	nr = min_t(uint64_t, nr, LUNIX_STATS_BUCKETS);
+	epoch = lunix_stats_epoch();
+
+	do {
+		start = read_seqbegin(&sensor->lock);
+		st.count = 0;
+		sum = 0;
+		st.min = INT_MAX;
+		st.max = INT_MIN;
+		for (i = 0; i < LUNIX_STATS_BUCKETS; i++) {
+			b = &stats->buckets[i];
+			if (b->count == 0 || b->epoch > epoch || epoch - b->epoch >= nr)
+				continue;
+			st.count += b->count;
+			sum += b->sum[type];
+			st.min = min_t(int64_t, st.min, b->min[type]);
+			st.max = max_t(int64_t, st.max, b->max[type]);
+		}
+		st.ewma = stats->ewma[type];
+	} while (read_seqretry(&sensor->lock, start));
+
+	st.window_ms = nr * lunix_stats_bucket_ms;
+	if (st.count == 0)
+		st.min = st.max = st.mean = 0;
+	else
+		st.mean = div64_s64(sum, st.count);
+
+	if (copy_to_user(ustats, &st, sizeof(st)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Joins or leaves the pool of exclusive readers of the measurement.
+ * Exclusive open files are kept at the tail of the wait queue of the
+ * sensor, so that waking one of them up never stops the sensor from
+ * reaching the rest of the open files.
+ */
+static long lunix_chrdev_ioctl_exclusive(struct lunix_chrdev_state_struct *state,
+	int __user *uarg)
+{
+	int exclusive;
+	unsigned long flags;
+	wait_queue_head_t *wq = &state->sensor->wq[state->type];
+
+	if (get_user(exclusive, uarg))
+		return -EFAULT;
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+	state->exclusive = !!exclusive;
+
+	spin_lock_irqsave(&wq->lock, flags);
+	if (state->exclusive) {
+		state->wait.flags |= WQ_FLAG_EXCLUSIVE;
+		list_move_tail(&state->wait.entry, &wq->head);
+	} else {
+		state->wait.flags &= ~WQ_FLAG_EXCLUSIVE;
+		list_move(&state->wait.entry, &wq->head);
+	}
+	spin_unlock_irqrestore(&wq->lock, flags);
+	up(&state->lock);
+
+	return 0;
+}
+
+/*
+ * Switches between text and binary records
+ */
+static long lunix_chrdev_ioctl_binary(struct lunix_chrdev_state_struct *state,
+	int __user *uarg)
+{
+	int binary;
+
+	if (get_user(binary, uarg))
+		return -EFAULT;
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+	state->binary = !!binary;
+	up(&state->lock);
+
+	return 0;
+}
+
+/*
+ * Sets the minimum interval between measurements reported
+ */
+static long lunix_chrdev_ioctl_interval(struct lunix_chrdev_state_struct *state,
+	uint32_t __user *uarg)
+{
+	uint32_t ms;
+
+	if (get_user(ms, uarg))
+		return -EFAULT;
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+	state->min_interval = ms_to_ktime(ms);
+	if (!ms)
+		WRITE_ONCE(state->next_delivery, 0);
+	up(&state->lock);
+
+	/* Anything held back can be reported right away */
+	if (!ms) {
+		hrtimer_cancel(&state->timer);
+		wake_up_interruptible(&state->wq);
+	}
+
+	return 0;
+}
+
+/*
+ * Sets the deadband around the last value reported
+ */
+static long lunix_chrdev_ioctl_deadband(struct lunix_chrdev_state_struct *state,
+	struct lunix_ioc_deadband_struct __user *udb)
+{
+	struct lunix_ioc_deadband_struct db;
+
+	if (copy_from_user(&db, udb, sizeof(db)))
+		return -EFAULT;
+	if (db.mode > LUNIX_DEADBAND_REL || db.threshold < 0 ||
+	    db.threshold > INT_MAX)
+		return -EINVAL;
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+	WRITE_ONCE(state->deadband_mode, db.mode);
+	WRITE_ONCE(state->deadband, db.threshold);
+	up(&state->lock);
+
 	return 0;
 }
 
 static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	/* Why? */
-	return -EINVAL;
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+
+	if (_IOC_TYPE(cmd) != LUNIX_IOC_MAGIC || _IOC_NR(cmd) > LUNIX_IOC_MAXNR)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case LUNIX_IOC_HISTORY:
+		return lunix_chrdev_ioctl_history(state, (void __user *)arg);
+	case LUNIX_IOC_EXCLUSIVE:
+		return lunix_chrdev_ioctl_exclusive(state, (int __user *)arg);
+	case LUNIX_IOC_STATS:
+		return lunix_chrdev_ioctl_stats(state, (void __user *)arg);
+	case LUNIX_IOC_DEADBAND:
+		return lunix_chrdev_ioctl_deadband(state, (void __user *)arg);
+	case LUNIX_IOC_BINARY:
+		return lunix_chrdev_ioctl_binary(state, (int __user *)arg);
+	case LUNIX_IOC_INTERVAL:
+		return lunix_chrdev_ioctl_interval(state, (uint32_t __user *)arg);
+	default:
+		return -ENOTTY;
+	}
 }
 
-static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
+/*
+ * Reads go through an iov_iter, so that they can also
+ * be spliced straight into a pipe, file or socket.
+ */
+static ssize_t lunix_chrdev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t ret;
 
+	struct file *filp = iocb->ki_filp;
+	size_t cnt = iov_iter_count(to);
+	int nonblock = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
 	struct lunix_sensor_struct *sensor;
 	struct lunix_chrdev_state_struct *state;
 	
 
 	state = filp->private_data;
 	WARN_ON(!state);
-	printk("This sensor is of type: %d\n", state->type);
+	debug("This sensor is of type: %d\n", state->type);
 	
 	sensor = state->sensor;
 	WARN_ON(!sensor);
-	printk("Last Update Cache: %d\n", state->buf_timestamp);
-	printk("Last Update Sensor: %d\n", sensor->msr_data[state->type]->last_update);
-	printk("Data: %s\n", state->buf_data);
+	debug("Last Update Cache: %llu\n", (unsigned long long)state->buf_seq);
+	debug("Last Update Sensor: %llu\n",
+		(unsigned long long)sensor->seq);
+
+	/* Binary records are never split across reads */
+	if (state->binary && cnt < sizeof(struct lunix_msr_sample_struct))
+		return -EINVAL;
 
 	/* Lock? */
-	if (down_interruptible(&state->lock))
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (down_trylock(&state->lock))
+			return -EAGAIN;
+	} else if (down_interruptible(&state->lock))
 		return -ERESTARTSYS;
 	
 	/*
@@ -181,7 +745,7 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 	 * updated by actual sensor data (i.e. we need to report
 	 * on a "fresh" measurement, do so
 	 */
-	if (*f_pos == 0) {
+	if (iocb->ki_pos == 0) {
 		while (lunix_chrdev_state_update(state) == -EAGAIN) {
 			up(&state->lock); /* release the lock */
 			
@@ -189,9 +753,20 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 			/* The process needs to sleep */
 			/* See LDD3, page 153 for a hint */
 			
- 			if (filp->f_flags & O_NONBLOCK)
+ 			if (nonblock)
  				return -EAGAIN;
- 			if (wait_event_interruptible(sensor->wq, lunix_chrdev_state_needs_refresh(state)))
+
+			/*
+			 * Exclusive open files may be shared by a pool of
+			 * workers, only wake one of them up per update.
+			 */
+			if (state->exclusive)
+				ret = wait_event_interruptible_exclusive(state->wq,
+					lunix_chrdev_state_needs_refresh(state));
+			else
+				ret = wait_event_interruptible(state->wq,
+					lunix_chrdev_state_needs_refresh(state));
+ 			if (ret)
  				return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
 
  			/* otherwise loop, but first reacquire the lock */
@@ -201,7 +776,7 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 	}
 
 	/* End of file */
-	if (*f_pos == state->buf_lim && false) {
+	if (iocb->ki_pos == state->buf_lim && false) {
 		ret = 0;
 		/* Auto-rewind on EOF mode? */
 		goto out;
@@ -212,22 +787,53 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 	if (size > state->buf_lim)
 		size = state->buf_lim;
 	
-	if (copy_to_user(usrbuf, state->buf_data, size)) {
+	if (copy_to_iter(state->buf_data, size, to) != size) {
 		ret = -EFAULT;
 		goto out;
 	}
-	*f_pos += size;
-	ret = *f_pos;
-	*f_pos = 0;
+	iocb->ki_pos += size;
+	ret = iocb->ki_pos;
+	iocb->ki_pos = 0;
 out:
 	/* Unlock? */
 	up(&state->lock);
 	return ret;
 }
 
+/*
+ * A measurement node is readable whenever read() would not block
+ */
+static unsigned int lunix_chrdev_poll(struct file *filp, poll_table *wait)
+{
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+
+	poll_wait(filp, &state->wq, wait);
+	if (lunix_chrdev_state_needs_refresh(state))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+/*
+ * Maps the page of the measurement read-only, so that userspace can
+ * follow it without any system calls; see struct lunix_msr_data_struct.
+ */
 static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	return -EINVAL;
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	struct lunix_msr_data_struct *msr = state->sensor->msr_data[state->type];
+
+	/* Compact sensors have no pages to map */
+	if (!msr)
+		return -ENODEV;
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(msr));
 }
 
 static struct file_operations lunix_chrdev_fops = 
@@ -235,19 +841,70 @@ static struct file_operations lunix_chrdev_fops =
         .owner          = THIS_MODULE,
 	.open           = lunix_chrdev_open,
 	.release        = lunix_chrdev_release,
-	.read           = lunix_chrdev_read,
+	.read_iter      = lunix_chrdev_read_iter,
+	.splice_read    = generic_file_splice_read,
+	.poll           = lunix_chrdev_poll,
 	.unlocked_ioctl = lunix_chrdev_ioctl,
 	.mmap           = lunix_chrdev_mmap
 };
 
-static void lunix_setup_cdev (struct cdev *dev, int index) {
-	int err, devno = MKDEV(LUNIX_CHRDEV_MAJOR, index);
-	cdev_init(dev, &lunix_chrdev_fops);
-	(*dev).owner = THIS_MODULE;
-	(*dev).ops = &lunix_chrdev_fops;
-	err = cdev_add(dev, devno, 1);
-	if (err)
-		printk(KERN_NOTICE "Error %d adding lunix%d", err, index);
+static void lunix_chrdev_create_devices(struct lunix_sensor_struct *sensor)
+{
+	int i;
+	int sensor_index = sensor->nodeid - 1;
+	dev_t dev_no = lunix_chrdev_dev_no + (sensor_index << 3);
+	struct device *dev;
+
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		dev = device_create(lunix_chrdev_class, NULL, dev_no + i, NULL,
+			"lunix%d-%s", sensor_index, lunix_chrdev_msr_names[i]);
+		if (!IS_ERR(dev))
+			dev = device_create(lunix_chrdev_class, NULL,
+				dev_no + (i | LUNIX_CHRDEV_BINARY), NULL,
+				"lunix%d-%s-bin", sensor_index, lunix_chrdev_msr_names[i]);
+		if (IS_ERR(dev))
+			printk(KERN_WARNING "Failed to create device nodes "
+				"for sensor %d, ret = %ld\n", sensor_index, PTR_ERR(dev));
+	}
+	sensor->has_devices = 1;
+}
+
+static void lunix_chrdev_destroy_devices(struct lunix_sensor_struct *sensor)
+{
+	int i;
+	dev_t dev_no = lunix_chrdev_dev_no + ((sensor->nodeid - 1) << 3);
+
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		device_destroy(lunix_chrdev_class, dev_no + i);
+		device_destroy(lunix_chrdev_class, dev_no + (i | LUNIX_CHRDEV_BINARY));
+	}
+	sensor->has_devices = 0;
+}
+
+static void lunix_chrdev_devices_work(struct work_struct *work)
+{
+	struct llist_node *list;
+	struct lunix_sensor_struct *sensor;
+
+	mutex_lock(&lunix_chrdev_devices_lock);
+	if (lunix_chrdev_class) {
+		list = llist_del_all(&lunix_chrdev_new_sensors);
+		llist_for_each_entry(sensor, list, devices_node)
+			lunix_chrdev_create_devices(sensor);
+	}
+	mutex_unlock(&lunix_chrdev_devices_lock);
+}
+static DECLARE_WORK(lunix_chrdev_devices_wk, lunix_chrdev_devices_work);
+
+/*
+ * Called for every new sensor, possibly in atomic context. Sensors
+ * created before the class are picked up when it gets created.
+ */
+void lunix_chrdev_sensor_created(struct lunix_sensor_struct *sensor)
+{
+	llist_add(&sensor->devices_node, &lunix_chrdev_new_sensors);
+	if (READ_ONCE(lunix_chrdev_class))
+		schedule_work(&lunix_chrdev_devices_wk);
 }
 
 int lunix_chrdev_init(void)
@@ -255,41 +912,66 @@ int lunix_chrdev_init(void)
 	/*
 	 * Register the character device with the kernel, asking for
 	 * a range of minor numbers (number of sensors * 8 measurements / sensor)
-	 * beginning with LINUX_CHRDEV_MAJOR:0
+	 * beginning with lunix_chrdev_major:0, or any free major if it is 0
 	 */
 	int ret;
 	dev_t dev_no;
+	struct device *dev;
 	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
 
-	lunix_states = (struct lunix_chrdev_state_struct*) kmalloc(sizeof(struct lunix_chrdev_state_struct)*lunix_minor_cnt, GFP_KERNEL);
-	/* Check if no ram */
-	
 	debug("initializing character device\n");
 	cdev_init(&lunix_chrdev_cdev, &lunix_chrdev_fops);
 	lunix_chrdev_cdev.owner = THIS_MODULE;
 	
-	dev_no = MKDEV(LUNIX_CHRDEV_MAJOR, 0);
-	/* ? */
-	ret = register_chrdev_region(dev_no, lunix_minor_cnt, "lunix");
+	if (lunix_chrdev_major) {
+		dev_no = MKDEV(lunix_chrdev_major, 0);
+		ret = register_chrdev_region(dev_no, lunix_minor_cnt, "lunix");
+	} else
+		ret = alloc_chrdev_region(&dev_no, 0, lunix_minor_cnt, "lunix");
 	if (ret < 0) {
 		debug("failed to register region, ret = %d\n", ret);
 		goto out;
 	}
-	int i, j;
-	for (i = 0; i < lunix_sensor_cnt; i++) {
-		for (j = 0; j < 3; j++) {
-			int minor = i * 8 + j;
-			debug("Registered cdev with minor: %d\n", minor);
-			lunix_setup_cdev(&lunix_chrdev_cdev, minor);
-		}
-	}
+	lunix_chrdev_dev_no = dev_no;
+	/*
+	 * A single cdev covers the whole range; sensors are
+	 * looked up by minor number when their nodes are opened,
+	 * and nodes of sensors not heard from yet fail with -ENODEV.
+	 */
+	ret = cdev_add(&lunix_chrdev_cdev, dev_no, lunix_minor_cnt);
 	if (ret < 0) {
 		debug("failed to add character device\n");
 		goto out_with_chrdev_region;
 	}
+
+	/*
+	 * Device nodes appear through the class, for the snapshot
+	 * device now and for each sensor as it gets created.
+	 */
+	lunix_chrdev_class = class_create(THIS_MODULE, "lunix");
+	if (IS_ERR(lunix_chrdev_class)) {
+		ret = PTR_ERR(lunix_chrdev_class);
+		lunix_chrdev_class = NULL;
+		goto out_with_cdev;
+	}
+	dev = device_create(lunix_chrdev_class, NULL,
+		dev_no + LUNIX_CHRDEV_SNAPSHOT_MINOR, NULL, "lunix-all");
+	if (IS_ERR(dev)) {
+		ret = PTR_ERR(dev);
+		goto out_with_class;
+	}
+
+	/* Sensors may have been created before we got here */
+	schedule_work(&lunix_chrdev_devices_wk);
+
 	debug("completed successfully\n");
 	return 0;
 
+out_with_class:
+	class_destroy(lunix_chrdev_class);
+	lunix_chrdev_class = NULL;
+out_with_cdev:
+	cdev_del(&lunix_chrdev_cdev);
 out_with_chrdev_region:
 	unregister_chrdev_region(dev_no, lunix_minor_cnt);
 out:
@@ -299,10 +981,31 @@ out:
 void lunix_chrdev_destroy(void)
 {
 	dev_t dev_no;
+	unsigned int i, n;
+	unsigned long nodeid;
+	struct lunix_sensor_struct *batch[LUNIX_CHRDEV_SNAPSHOT_BATCH];
 	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
 		
 	debug("entering\n");
-	dev_no = MKDEV(LUNIX_CHRDEV_MAJOR, 0);
+	dev_no = lunix_chrdev_dev_no;
+
+	/*
+	 * Stop creating device nodes, then remove the ones created
+	 */
+	cancel_work_sync(&lunix_chrdev_devices_wk);
+	mutex_lock(&lunix_chrdev_devices_lock);
+	nodeid = 0;
+	while ((n = lunix_sensors_lookup(batch, nodeid, ARRAY_SIZE(batch))) > 0) {
+		for (i = 0; i < n; i++)
+			if (batch[i]->has_devices)
+				lunix_chrdev_destroy_devices(batch[i]);
+		nodeid = batch[n - 1]->nodeid + 1;
+	}
+	device_destroy(lunix_chrdev_class, dev_no + LUNIX_CHRDEV_SNAPSHOT_MINOR);
+	class_destroy(lunix_chrdev_class);
+	lunix_chrdev_class = NULL;
+	mutex_unlock(&lunix_chrdev_devices_lock);
+
 	cdev_del(&lunix_chrdev_cdev);
 	unregister_chrdev_region(dev_no, lunix_minor_cnt);
 	debug("leaving\n");
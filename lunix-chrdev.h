@@ -11,16 +11,34 @@
 #define _LUNIX_CHRDEV_H
 
 /*
- * Lunix:TNG character device
+ * Lunix:TNG character device. Its major number is set at module
+ * load time [lunix_chrdev_major], 0 meaning any free one.
  */
 #define LUNIX_CHRDEV_MAJOR	60	/* Reserved for local / experimental use */
 #define LUNIX_CHRDEV_BUFSZ  200 /* Buffer size used to hold textual info */
 
+/*
+ * Each sensor has 8 minor numbers: one per measurement, returning
+ * text, and the same ones with LUNIX_CHRDEV_BINARY set, returning
+ * binary records [struct lunix_msr_sample_struct].
+ */
+#define LUNIX_CHRDEV_BINARY	4
+
+/*
+ * The last minor number of the first sensor, which has no measurement
+ * behind it, is the snapshot device: a single read returns the latest
+ * measurements of every sensor heard from so far.
+ */
+#define LUNIX_CHRDEV_SNAPSHOT_MINOR	7
+#define LUNIX_CHRDEV_SNAPSHOT_BATCH	16	/* Sensors looked up at a time */
+
 /* Compile-time parameters */
 
 #ifdef __KERNEL__ 
 
 #include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 
@@ -36,7 +54,42 @@ struct lunix_chrdev_state_struct {
 	/* A buffer used to hold cached textual info */
 	int buf_lim;
 	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ];
-	uint32_t buf_timestamp;
+	uint64_t buf_seq;	/* Sequence number of the cached measurement */
+
+	long buf_value;		/* Cooked value of the cached measurement */
+
+	/*
+	 * Set if each update is only to be reported
+	 * to one of the exclusive readers of the sensor
+	 */
+	int exclusive;
+
+	/* Set if reads return binary records instead of text */
+	int binary;
+
+	/*
+	 * Only report measurements which moved past a deadband
+	 * around the last value reported, see LUNIX_IOC_DEADBAND
+	 */
+	uint32_t deadband_mode;
+	int64_t deadband;
+
+	/*
+	 * Measurements are reported at most once every min_interval;
+	 * updates in between are coalesced and the latest one is
+	 * reported at next_delivery, when the timer fires.
+	 */
+	ktime_t min_interval;
+	ktime_t next_delivery;
+	struct hrtimer timer;
+
+	/*
+	 * Readers of this open file sleep on its own wait queue. The file
+	 * itself waits on the sensor, and only wakes them up when an
+	 * update is of interest to them; see lunix_chrdev_wake().
+	 */
+	wait_queue_head_t wq;
+	wait_queue_entry_t wait;
 
 	struct semaphore lock;
 
@@ -48,20 +101,109 @@ struct lunix_chrdev_state_struct {
 /*
  * Function prototypes
  */
+extern int lunix_chrdev_major;
+
 int lunix_chrdev_init(void);
 void lunix_chrdev_destroy(void);
+void lunix_chrdev_sensor_created(struct lunix_sensor_struct *sensor);
 
 #endif	/* __KERNEL__ */
 
 #include <linux/ioctl.h>
 
+#include "lunix.h"
+
+/*
+ * Argument of LUNIX_IOC_HISTORY: fetches up to 'count' samples
+ * with a sequence number greater than 'since', oldest first,
+ * into the array of struct lunix_msr_sample_struct at 'samples'.
+ * On return, 'count' holds the number of samples fetched.
+ */
+struct lunix_ioc_history_struct {
+	uint64_t since;
+	uint64_t samples;	/* User pointer */
+	uint32_t count;
+	uint32_t __pad;
+};
+
+/*
+ * Argument of LUNIX_IOC_STATS: summarizes the samples received over
+ * the last 'window_ms' milliseconds [0 for the longest window kept].
+ * Windows are rounded up to whole buckets, of a length set at module
+ * load time; on return, 'window_ms' holds the window actually used.
+ * Values are in thousandths of the relevant unit. The exponentially
+ * weighted moving average covers all samples since the sensor was
+ * first heard from.
+ */
+struct lunix_ioc_stats_struct {
+	uint32_t window_ms;
+	uint32_t count;
+	int64_t min;
+	int64_t max;
+	int64_t mean;
+	int64_t ewma;
+};
+
+/*
+ * An entry returned by the snapshot device. Reads at offset 0 return
+ * three entries per sensor heard from, one per measurement, in order
+ * of node id, as many as fit in the buffer; reads past the snapshot
+ * return end of file. The three entries of a sensor always come
+ * from the same update.
+ */
+struct lunix_snapshot_entry_struct {
+	uint64_t seq;
+	uint64_t timestamp;	/* In ns since the Epoch */
+	uint16_t nodeid;
+	uint16_t type;		/* BATT, TEMP or LIGHT */
+	uint32_t value;
+	int32_t cooked;		/* In thousandths of the unit */
+	uint32_t __pad;
+};
+
+/*
+ * Argument of LUNIX_IOC_DEADBAND: readers are only woken up for
+ * measurements which differ from the last one reported by at least
+ * 'threshold', in thousandths of the unit [LUNIX_DEADBAND_ABS] or
+ * in thousandths of the last value reported [LUNIX_DEADBAND_REL].
+ */
+#define LUNIX_DEADBAND_NONE		0
+#define LUNIX_DEADBAND_ABS		1
+#define LUNIX_DEADBAND_REL		2
+
+struct lunix_ioc_deadband_struct {
+	uint32_t mode;
+	uint32_t __pad;
+	int64_t threshold;
+};
+
 /*
  * Definition of ioctl commands
+ *
+ * LUNIX_IOC_EXCLUSIVE takes an int: if non-zero, the open file joins
+ * the pool of exclusive readers of the measurement. Each update is
+ * reported to only one of them, handed off round-robin to those
+ * sleeping in read().
+ *
+ * LUNIX_IOC_BINARY takes an int: if non-zero, reads on the open file
+ * return a struct lunix_msr_sample_struct per measurement, holding
+ * the raw and cooked values, instead of a line of text. Reads shorter
+ * than a record fail with EINVAL.
+ *
+ * LUNIX_IOC_INTERVAL takes a uint32_t: the minimum interval between
+ * measurements reported on the open file, in milliseconds [0 for
+ * none]. Readers are woken up at most once per interval, with the
+ * latest measurement received.
  */
 #define LUNIX_IOC_MAGIC			LUNIX_CHRDEV_MAJOR
-//#define LUNIX_IOC_EXAMPLE		_IOR(LUNIX_IOC_MAGIC, 0, void *)
-
-#define LUNIX_IOC_MAXNR			0	
+#define LUNIX_IOC_HISTORY		_IOWR(LUNIX_IOC_MAGIC, 0, struct lunix_ioc_history_struct)
+#define LUNIX_IOC_EXCLUSIVE		_IOW(LUNIX_IOC_MAGIC, 1, int)
+#define LUNIX_IOC_STATS			_IOWR(LUNIX_IOC_MAGIC, 2, struct lunix_ioc_stats_struct)
+#define LUNIX_IOC_DEADBAND		_IOW(LUNIX_IOC_MAGIC, 3, struct lunix_ioc_deadband_struct)
+#define LUNIX_IOC_BINARY		_IOW(LUNIX_IOC_MAGIC, 4, int)
+#define LUNIX_IOC_INTERVAL		_IOW(LUNIX_IOC_MAGIC, 5, uint32_t)
+
+#define LUNIX_IOC_MAXNR			5
 
 #endif	/* _LUNIX_H */
 
@@ -8,13 +8,18 @@
  */
 
 #include <linux/tty.h>
+#include <linux/tty_flip.h>
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/serio.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
 
 #include <asm/atomic.h>
+#include <asm/barrier.h>
 #include <asm/uaccess.h>
 
 #include "lunix.h"
@@ -22,27 +27,63 @@
 #include "lunix-protocol.h"
 
 /*
- * This line discipline can only be associated
- * with a single TTY at any time.
+ * This line discipline can be associated with
+ * up to LUNIX_LDISC_MAX_LINES TTYs at any time.
  */
 static atomic_t lunix_disc_available;
 
+/*
+ * Every line gets a unique id, so that the sensor code
+ * can tell where each measurement came from.
+ */
+static atomic_t lunix_disc_line_id;
+
+/*
+ * Workqueue running the parsers of lines in deferred mode
+ */
+static struct workqueue_struct *lunix_ldisc_wq;
+
+static void lunix_ldisc_work(struct work_struct *work);
+
 /*
  * This function runs when the userspace helper
  * sets the Lunix:TNG line discipline on a TTY.
  */
 static int lunix_ldisc_open(struct tty_struct *tty)
 {
+	struct lunix_ldisc_line_struct *line;
+
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
 	
-	/* Can only be associated with a single TTY */
+	/* Can only be associated with a limited number of TTYs */
 	if ( !atomic_add_unless(&lunix_disc_available, -1, 0))
 		return -EBUSY;
 
-	tty->receive_room = 65536; /* No flow control, FIXME */
+	line = kzalloc(sizeof(*line), GFP_KERNEL);
+	if (!line) {
+		atomic_inc(&lunix_disc_available);
+		return -ENOMEM;
+	}
+	line->tty = tty;
+	lunix_protocol_init(&line->proto, atomic_inc_return(&lunix_disc_line_id));
+
+	line->deferred = lunix_ldisc_deferred;
+	if (line->deferred) {
+		line->ring.data = kmalloc(2 * LUNIX_LDISC_RING_SIZE, GFP_KERNEL);
+		if (!line->ring.data) {
+			kfree(line);
+			atomic_inc(&lunix_disc_available);
+			return -ENOMEM;
+		}
+		line->ring.flags = line->ring.data + LUNIX_LDISC_RING_SIZE;
+		INIT_WORK(&line->work, lunix_ldisc_work);
+		mutex_init(&line->throttle_lock);
+	}
+	tty->disc_data = line;
 
-	debug("lunix ldisc associated with TTY %s\n", tty->name);
+	debug("lunix ldisc associated with TTY %s as line %d\n",
+		tty->name, line->proto.line);
 	return 0;
 }
 
@@ -53,21 +94,174 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 
 static void lunix_ldisc_close(struct tty_struct *tty)
 {
-	atomic_inc(&lunix_disc_available);
+	struct lunix_ldisc_line_struct *line = tty->disc_data;
+
+	/*
+	 * No more characters will be received,
+	 * stop the worker of a deferred line.
+	 */
+	if (line->deferred) {
+		cancel_work_sync(&line->work);
+		line->dropped += line->ring.head - line->ring.tail;
+		kfree(line->ring.data);
+	}
+
 	/* FIXME */
 	/* Shouldn't we wake up all sleepers in all sensors here? */
-	debug("lunix ldisc being closed\n");
+	debug("lunix ldisc being closed on TTY %s, %lu packets received, "
+		"%lu bad CRCs, %lu resyncs, %lu bytes discarded, %lu duplicates, "
+		"throttled %lu times, %lu characters throttled, %lu dropped\n",
+		tty->name, line->pkt_cnt, line->proto.crc_errors,
+		line->proto.resyncs, line->proto.discarded, line->proto.duplicates,
+		line->throttle_cnt, line->throttled_chars, line->dropped);
+
+	tty->disc_data = NULL;
+	kfree(line);
+	atomic_inc(&lunix_disc_available);
+}
+
+/*
+ * Feeds incoming characters to the protocol state machine. Characters
+ * flagged by the low level TTY driver (framing or parity errors, overruns,
+ * breaks) cannot be trusted: the packet they belong to is dropped at once
+ * and the protocol code starts hunting for the next start byte.
+ *
+ * Returns the number of complete packets received.
+ */
+static int lunix_ldisc_feed(struct lunix_protocol_state_struct *state,
+	const unsigned char *cp, const char *fp, int count)
+{
+	int i;
+	int done;
+	int packets;
+
+	if (!fp)
+		return lunix_protocol_received_buf(state, cp, count);
+
+	packets = 0;
+	for (i = done = 0; i < count; i++) {
+		if (fp[i] == TTY_NORMAL)
+			continue;
+		debug("flag %d on character 0x%02x, resyncing\n", fp[i], cp[i]);
+		packets += lunix_protocol_received_buf(state, &cp[done], i - done);
+		lunix_protocol_resync(state, 1);
+		done = i + 1;
+	}
+	packets += lunix_protocol_received_buf(state, &cp[done], count - done);
+
+	return packets;
+}
+
+/*
+ * Queues as many characters as fit on the ring of a deferred line.
+ * Only ever called from the TTY receive path, the single producer.
+ *
+ * Returns the number of characters queued.
+ */
+static int lunix_ldisc_ring_put(struct lunix_ldisc_ring_struct *ring,
+	const unsigned char *cp, const char *fp, int count)
+{
+	unsigned int head, tail, off;
+	int n, chunk;
+
+	head = ring->head;
+	tail = smp_load_acquire(&ring->tail);
+	n = min_t(unsigned int, count, LUNIX_LDISC_RING_SIZE - (head - tail));
+
+	/* The free space may wrap around the end of the ring */
+	for (count = n; count > 0; count -= chunk) {
+		off = head & (LUNIX_LDISC_RING_SIZE - 1);
+		chunk = min_t(unsigned int, count, LUNIX_LDISC_RING_SIZE - off);
+		memcpy(&ring->data[off], cp, chunk);
+		if (fp) {
+			memcpy(&ring->flags[off], fp, chunk);
+			fp += chunk;
+		} else
+			memset(&ring->flags[off], TTY_NORMAL, chunk);
+		cp += chunk;
+		head += chunk;
+	}
+
+	/* Publish the characters to the worker */
+	smp_store_release(&ring->head, head);
+
+	return n;
+}
+
+/*
+ * The worker of a deferred line, the single consumer of its ring.
+ * Parses everything queued so far, a contiguous chunk at a time.
+ */
+static void lunix_ldisc_work(struct work_struct *work)
+{
+	struct lunix_ldisc_line_struct *line;
+	struct lunix_ldisc_ring_struct *ring;
+	unsigned int head, tail, off;
+	int chunk;
+
+	line = container_of(work, struct lunix_ldisc_line_struct, work);
+	ring = &line->ring;
+
+	tail = ring->tail;
+	while ((head = smp_load_acquire(&ring->head)) != tail) {
+		off = tail & (LUNIX_LDISC_RING_SIZE - 1);
+		chunk = min_t(unsigned int, head - tail, LUNIX_LDISC_RING_SIZE - off);
+		line->pkt_cnt += lunix_ldisc_feed(&line->proto,
+			&ring->data[off], &ring->flags[off], chunk);
+		tail += chunk;
+
+		/* Hand the space back to the TTY receive path */
+		smp_store_release(&ring->tail, tail);
+	}
+
+	/*
+	 * There is room again: unthrottle the TTY once we are below the
+	 * low watermark, and have the TTY layer push any characters we
+	 * could not take earlier. tty_flip_buffer_push() is what kicks
+	 * the flip buffer work from a module: the internal restart helper
+	 * n_tty uses is not exported.
+	 */
+	mutex_lock(&line->throttle_lock);
+	if (line->throttled &&
+	    smp_load_acquire(&ring->head) - tail < LUNIX_LDISC_RING_LOW) {
+		line->throttled = 0;
+		tty_unthrottle(line->tty);
+	}
+	mutex_unlock(&line->throttle_lock);
+	if (READ_ONCE(line->stalled)) {
+		WRITE_ONCE(line->stalled, 0);
+		tty_flip_buffer_push(line->tty->port);
+	}
+}
+
+/*
+ * Kicks the worker of a deferred line,
+ * on the configured CPU if there is one.
+ */
+static void lunix_ldisc_queue_work(struct lunix_ldisc_line_struct *line)
+{
+	int cpu = lunix_ldisc_worker_cpu;
+
+	if (cpu >= 0 && cpu < nr_cpu_ids && cpu_online(cpu))
+		queue_work_on(cpu, lunix_ldisc_wq, &line->work);
+	else
+		queue_work(lunix_ldisc_wq, &line->work);
 }
 
 /*
  * lunix_ldisc_receive() is called by the TTY layer when data have been
  * received by the low level TTY driver and are ready for us. This function
  * will not be re-entered while running.
+ *
+ * Returns the number of characters we have taken. Whatever we do not
+ * take stays with the TTY layer, until the worker makes room for it.
  */
-static void lunix_ldisc_receive(struct tty_struct *tty,
+static int lunix_ldisc_receive(struct tty_struct *tty,
 	const unsigned char *cp, char *fp, int count)
 {
-#if 1
+	int queued, seen;
+	struct lunix_ldisc_line_struct *line = tty->disc_data;
+
 #if LUNIX_DEBUG
 	int i;
 
@@ -76,14 +270,79 @@ static void lunix_ldisc_receive(struct tty_struct *tty,
 		printk("0x%02x%s", cp[i], (i == count - 1) ? "" : ", ");
 	printk(" }\n");
 #endif
-	printk(KERN_INFO "lunix_ldisc_receive called\n");
-#endif
+	/*
+	 * In deferred mode, just queue the incoming characters
+	 * and let the worker do the rest.
+	 */
+	if (line->deferred) {
+		queued = lunix_ldisc_ring_put(&line->ring, cp, fp, count);
+
+		/*
+		 * The TTY layer offers characters we did not take again,
+		 * first thing; only count the ones left for the first time.
+		 */
+		seen = max_t(int, queued, line->pending);
+		if (count > seen)
+			line->throttled_chars += count - seen;
+		line->pending = max_t(int, line->pending, count) - queued;
+		if (queued < count)
+			WRITE_ONCE(line->stalled, 1);
+
+		/*
+		 * The worker is kicked after throttling, so it gets to see
+		 * the TTY throttled and unthrottles it once there is room.
+		 */
+		mutex_lock(&line->throttle_lock);
+		if (!line->throttled &&
+		    line->ring.head - smp_load_acquire(&line->ring.tail) > LUNIX_LDISC_RING_HIGH) {
+			line->throttled = 1;
+			line->throttle_cnt++;
+			tty_throttle(tty);
+		}
+		mutex_unlock(&line->throttle_lock);
+		lunix_ldisc_queue_work(line);
+		return queued;
+	}
+
 	/*
 	 * Pass incoming characters to protocol processing code,
 	 * which handle any necessary sensor updates.
 	 */
-	lunix_protocol_received_buf(&lunix_protocol_state, cp, count);
+	line->pkt_cnt += lunix_ldisc_feed(&line->proto, cp, fp, count);
 	//debug("passed incoming bytes to state machine, leaving\n");
+	return count;
+}
+
+/*
+ * Line discipline specific ioctls, on the TTY itself.
+ * Everything else is handled as for the default discipline,
+ * so that termios can still be manipulated.
+ */
+static int lunix_ldisc_ioctl(struct tty_struct *tty, struct file *file,
+	unsigned int cmd, unsigned long arg)
+{
+	struct lunix_ldisc_line_struct *line = tty->disc_data;
+	struct lunix_ldisc_stats_struct stats;
+
+	switch (cmd) {
+	case LUNIX_LDISC_IOC_STATS:
+		memset(&stats, 0, sizeof(stats));
+		stats.packets = line->pkt_cnt;
+		stats.crc_errors = line->proto.crc_errors;
+		stats.resyncs = line->proto.resyncs;
+		stats.discarded = line->proto.discarded;
+		stats.duplicates = line->proto.duplicates;
+		if (line->deferred)
+			stats.queued = READ_ONCE(line->ring.head) - READ_ONCE(line->ring.tail);
+		stats.throttle_cnt = line->throttle_cnt;
+		stats.throttled = line->throttled_chars;
+		stats.dropped = line->dropped;
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	default:
+		return n_tty_ioctl_helper(tty, file, cmd, arg);
+	}
 }
 
 /*
@@ -117,7 +376,8 @@ static struct tty_ldisc_ops lunix_ldisc_ops = {
 	.close =	lunix_ldisc_close,
 	.read =		lunix_ldisc_read,
 	.write =	lunix_ldisc_write,
-	.receive_buf =	lunix_ldisc_receive
+	.ioctl =	lunix_ldisc_ioctl,
+	.receive_buf2 =	lunix_ldisc_receive
 };
 
 int lunix_ldisc_init(void)
@@ -125,10 +385,20 @@ int lunix_ldisc_init(void)
 	int ret;
 
 	debug("initializing lunix ldisc\n");
-	atomic_set(&lunix_disc_available, 1);
+	atomic_set(&lunix_disc_available, LUNIX_LDISC_MAX_LINES);
+	atomic_set(&lunix_disc_line_id, 0);
+
+	lunix_ldisc_wq = alloc_workqueue("lunix", WQ_HIGHPRI, 0);
+	if (!lunix_ldisc_wq) {
+		printk(KERN_ERR "%s: Error allocating workqueue.\n", __FILE__);
+		return -ENOMEM;
+	}
+
 	ret = tty_register_ldisc(N_LUNIX_LDISC, &lunix_ldisc_ops);
-	if (ret)
+	if (ret) {
 		printk(KERN_ERR "%s: Error registering line discipline, ret = %d.\n", __FILE__, ret);
+		destroy_workqueue(lunix_ldisc_wq);
+	}
 	
 	debug("leaving with ret = %d\n", ret);
 	return ret;
@@ -138,6 +408,7 @@ void lunix_ldisc_destroy(void)
 {
 	debug("unregistering lunix ldisc\n");
 	tty_unregister_ldisc(N_LUNIX_LDISC);
+	destroy_workqueue(lunix_ldisc_wq);
 	debug("lunix ldisc unregistered\n");
 }
 
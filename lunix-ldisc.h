@@ -12,9 +12,79 @@
 #define _LUNIX_LDISC_H
 
 /* Compile-time parameters */
+#define LUNIX_LDISC_MAX_LINES	8	/* Maximum number of TTYs attached at once */
+#define LUNIX_LDISC_RING_SIZE	16384	/* Bytes buffered per line in deferred mode, power of 2 */
+#define LUNIX_LDISC_RING_HIGH	(LUNIX_LDISC_RING_SIZE * 3 / 4)	/* Throttle the TTY above this */
+#define LUNIX_LDISC_RING_LOW	(LUNIX_LDISC_RING_SIZE / 4)	/* Unthrottle it below this */
 
 #ifdef __KERNEL__ 
 
+#include <linux/cache.h>
+#include <linux/workqueue.h>
+
+#include "lunix-protocol.h"
+
+/*
+ * Set to parse incoming data in a worker rather than
+ * in the TTY receive path, optionally bound to a CPU.
+ */
+extern int lunix_ldisc_deferred;
+extern int lunix_ldisc_worker_cpu;
+
+/*
+ * Single-producer, single-consumer ring of received characters
+ * and their TTY flags. The TTY receive path only ever advances
+ * head, the worker only ever advances tail, so no lock is needed.
+ * Both are free running and masked on access.
+ */
+struct lunix_ldisc_ring_struct {
+	unsigned int head ____cacheline_aligned_in_smp;
+	unsigned int tail ____cacheline_aligned_in_smp;
+	unsigned char *data;
+	char *flags;
+};
+
+/*
+ * Private state for a TTY the Lunix line discipline
+ * has been set on. Every line runs its own copy of
+ * the protocol state machine.
+ */
+struct lunix_ldisc_line_struct {
+	struct tty_struct *tty;
+	struct lunix_protocol_state_struct proto;
+
+	/* Number of complete XMesh packets received on this line */
+	unsigned long pkt_cnt;
+
+	/*
+	 * In deferred mode, characters are queued on the ring
+	 * and parsed in batches by the work item.
+	 */
+	int deferred;
+	struct lunix_ldisc_ring_struct ring;
+	struct work_struct work;
+
+	/*
+	 * Flow control: the TTY is throttled while the ring is above the
+	 * high watermark. 'throttled' only changes along with the call to
+	 * throttle or unthrottle the TTY, under throttle_lock, so the two
+	 * always agree. Characters which do not fit in the ring are left
+	 * with the TTY layer, and 'stalled' tells the worker to have them
+	 * pushed to us again once it has made room; 'pending' of them,
+	 * at the start of what the TTY layer offers next, were already
+	 * counted in throttled_chars.
+	 */
+	struct mutex throttle_lock;
+	int throttled;
+	int stalled;
+	unsigned int pending;
+	unsigned long throttle_cnt;	/* Number of times the TTY was throttled */
+	unsigned long throttled_chars;	/* Characters left with the TTY layer */
+
+	/* Number of characters dropped, still queued when the line was closed */
+	unsigned long dropped;
+};
+
 /*
  * Function prototypes
  */
@@ -23,5 +93,28 @@ void lunix_ldisc_destroy(void);
 
 #endif	/* __KERNEL__ */
 
+#include <linux/ioctl.h>
+
+/*
+ * Statistics of a line, as returned by LUNIX_LDISC_IOC_STATS
+ */
+struct lunix_ldisc_stats_struct {
+	uint64_t packets;		/* Complete XMesh packets received */
+	uint64_t crc_errors;		/* Packets dropped due to a bad CRC */
+	uint64_t resyncs;		/* Times sync with the input stream was lost */
+	uint64_t discarded;		/* Bytes thrown away while resyncing */
+	uint64_t duplicates;		/* Packets already received on another line */
+	uint64_t queued;		/* Characters currently waiting on the ring */
+	uint64_t throttle_cnt;		/* Times the TTY was throttled */
+	uint64_t throttled;		/* Characters left with the TTY layer */
+	uint64_t dropped;		/* Characters dropped */
+};
+
+/*
+ * Definition of ioctl commands, issued on the TTY itself
+ */
+#define LUNIX_LDISC_IOC_MAGIC		'X'
+#define LUNIX_LDISC_IOC_STATS		_IOR(LUNIX_LDISC_IOC_MAGIC, 0, struct lunix_ldisc_stats_struct)
+
 #endif	/* _LUNIX_H */
 
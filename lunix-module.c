@@ -20,8 +20,12 @@
  * Global state for Lunix:TNG sensors
  */
 int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
-struct lunix_sensor_struct *lunix_sensors;
-struct lunix_protocol_state_struct lunix_protocol_state;
+int lunix_dedup_window_ms = LUNIX_DEDUP_WINDOW_MS;
+int lunix_sensor_compact = 0;
+int lunix_stats_bucket_ms = LUNIX_STATS_BUCKET_MS;
+int lunix_chrdev_major = LUNIX_CHRDEV_MAJOR;
+int lunix_ldisc_deferred = 0;
+int lunix_ldisc_worker_cpu = -1;
 
 /*
  * Module init and cleanup functions
@@ -30,31 +34,27 @@ struct lunix_protocol_state_struct lunix_protocol_state;
 int __init lunix_module_init(void)
 {
 	int ret;
-	int si_done;
+
+	/*
+	 * Node ids are 16-bit. Sensors themselves are
+	 * created on demand, as nodes are heard from.
+	 */
+	if (lunix_sensor_cnt < 1)
+		lunix_sensor_cnt = LUNIX_SENSOR_CNT;
+	if (lunix_sensor_cnt > LUNIX_SENSOR_MAX)
+		lunix_sensor_cnt = LUNIX_SENSOR_MAX;
+
+	if (lunix_stats_bucket_ms < 1)
+		lunix_stats_bucket_ms = LUNIX_STATS_BUCKET_MS;
 
 	printk(KERN_INFO "Initializing the Lunix:TNG module [max %d sensors]\n",
 		lunix_sensor_cnt);
 
-	ret = -ENOMEM;
-	lunix_sensors = kzalloc(sizeof(*lunix_sensors) * lunix_sensor_cnt, GFP_KERNEL);
-	if (!lunix_sensors) {
-		printk(KERN_ERR "Failed to allocate memory for Lunix sensors\n");
-		goto out;
-	}
-	lunix_protocol_init(&lunix_protocol_state);
-
 	/*
-	 * Initialize all sensors. On exit, si_done is the index of the last
-	 * successfully initialized sensor.
+	 * Preallocate sensors for the first nodes to be heard from
 	 */
-	for (si_done = -1; si_done < lunix_sensor_cnt - 1; si_done++) {
-		debug("initializing sensor %d\n", si_done + 1);
-		ret = lunix_sensor_init(&lunix_sensors[si_done + 1]);
-		debug("initialized sensor %d, ret = %d\n", si_done + 1, ret);
-		if (ret < 0) {
-			goto out_with_sensors;
-		}
-	}
+	if ((ret = lunix_sensors_init()) < 0)
+		goto out;
 
 	/*
 	 * Initialize the Lunix line discipline
@@ -77,12 +77,9 @@ int __init lunix_module_init(void)
 out_with_ldisc:
 	debug("at out_with_ldisc\n");
 	lunix_ldisc_destroy();
-
 out_with_sensors:
 	debug("at out_with_sensors\n");
-	for (; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+	lunix_sensors_destroy();
 
 out:
 	debug("at out\n");
@@ -91,16 +88,12 @@ out:
 
 void __exit lunix_module_cleanup(void)
 {
-	int si_done;
-	
 	debug("entering, destroying chrdev and ldisc\n");
 	lunix_chrdev_destroy();
 	lunix_ldisc_destroy();
 	
 	debug("destroying sensor buffers\n");
-	for (si_done = lunix_sensor_cnt - 1; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+	lunix_sensors_destroy();
 
 	printk(KERN_INFO "Lunix:TNG module unloaded successfully\n");
 }
@@ -115,6 +108,18 @@ MODULE_LICENSE("GPL");
 
 module_param(lunix_sensor_cnt, int, 0);
 MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors to support");
+module_param(lunix_chrdev_major, int, 0);
+MODULE_PARM_DESC(lunix_chrdev_major, "Major number of the character device [0 for any free one]");
+module_param(lunix_sensor_compact, int, 0);
+MODULE_PARM_DESC(lunix_sensor_compact, "Keep only the most recent measurements, without history pages");
+module_param(lunix_stats_bucket_ms, int, 0);
+MODULE_PARM_DESC(lunix_stats_bucket_ms, "Granularity of rolling statistics windows [ms]");
+module_param(lunix_dedup_window_ms, int, 0);
+MODULE_PARM_DESC(lunix_dedup_window_ms, "Window for suppressing duplicates received on different lines [ms]");
+module_param(lunix_ldisc_deferred, int, 0);
+MODULE_PARM_DESC(lunix_ldisc_deferred, "Parse incoming data in a worker instead of the TTY receive path");
+module_param(lunix_ldisc_worker_cpu, int, 0);
+MODULE_PARM_DESC(lunix_ldisc_worker_cpu, "CPU to run the parsing worker on [-1 for any]");
 
 module_init(lunix_module_init);
 module_exit(lunix_module_cleanup);
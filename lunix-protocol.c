@@ -14,11 +14,14 @@
  *
  */
 
+#include <linux/slab.h>
 #include <linux/kernel.h>
+#include <linux/printk.h>
 #include <asm/byteorder.h>
 
 #include "lunix.h"
 #include "lunix-protocol.h"
+#include "lunix-crc-tables.h"
 
 /*
  * Returns an unsigned 16-bit integer in native byte-order from 
@@ -32,6 +35,26 @@ static uint16_t uint16_from_packet(unsigned char *p)
 	return le16_to_cpu(le);
 }
 
+/*
+ * Updates a running CRC-CCITT with len more bytes of the packet.
+ * Four bytes are folded in per iteration using the slice-by-4 tables.
+ */
+static uint16_t lunix_protocol_crc_update(uint16_t crc, const unsigned char *p, int len)
+{
+	while (len >= 4) {
+		crc = lunix_crc_table[3][(crc >> 8) ^ p[0]] ^
+		      lunix_crc_table[2][(crc & 0xFF) ^ p[1]] ^
+		      lunix_crc_table[1][p[2]] ^
+		      lunix_crc_table[0][p[3]];
+		p += 4;
+		len -= 4;
+	}
+	while (len-- > 0)
+		crc = (crc << 8) ^ lunix_crc_table[0][(crc >> 8) ^ *p++];
+
+	return crc;
+}
+
 /*
  * Will display the contents of an incoming XMesh packet
  * that have been received so far
@@ -54,8 +77,10 @@ static inline void lunix_protocol_show_packet(struct lunix_protocol_state_struct
  * types of packets. In future releases check packets with packet[4]
  * equal to 0x03, 0xFD for extending this function.
  */
-static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state, struct lunix_sensor_struct *lunix_sensors)
+static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state)
 {
+	struct lunix_sensor_struct *sensor;
+
 	uint16_t batt;
 	uint16_t temp;
 	uint16_t light;
@@ -74,10 +99,18 @@ static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *st
 		//debug ("I have the following raw data from nodeid = %d: { batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
 		//	nodeid, batt, temp, light);
 
-		if (nodeid > 0 && nodeid <= lunix_sensor_cnt)
-			lunix_sensor_update(&lunix_sensors[nodeid - 1], batt, temp, light);
-		else
-			printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
+		/*
+		 * The first packet from a node creates its sensor.
+		 * We may be running in atomic context here.
+		 */
+		sensor = lunix_sensor_get(nodeid, GFP_ATOMIC);
+		if (sensor) {
+			if (lunix_sensor_update(sensor, state->line,
+					batt, temp, light) < 0)
+				state->duplicates++;
+		} else
+			printk_ratelimited(KERN_WARNING "Node id %d is out of bounds "
+				"[maximum %d sensors] or out of memory\n",
 				nodeid, lunix_sensor_cnt);
 	}
 }
@@ -96,6 +129,21 @@ static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *st
  * (7 + PL + 2)			0X7E		Packet End byte signature
  **********************************************************************************/
 
+/*
+ * The CRC covers everything from the packet type up to and including
+ * the payload, after special characters have been unescaped. It is
+ * transmitted little-endian, right before the end byte.
+ */
+static inline int lunix_protocol_crc_covers(int state)
+{
+	return state >= SEEKING_PACKET_TYPE && state <= SEEKING_PAYLOAD;
+}
+
+static inline int lunix_protocol_crc_ok(struct lunix_protocol_state_struct *state)
+{
+	return state->crc == uint16_from_packet(&state->packet[state->pos - 3]);
+}
+
 /*
  * Helper function to quickly set the current state
  */
@@ -112,17 +160,76 @@ static inline void set_state(struct lunix_protocol_state_struct *statep, int sta
 /*
  * Initialization of protocol state machine
  */
-void lunix_protocol_init(struct lunix_protocol_state_struct *state)
+void lunix_protocol_init(struct lunix_protocol_state_struct *state, int line)
+{
+	state->line = line;
+	state->pos = 0;
+	state->next_is_special = 0;
+	state->crc = 0;
+	state->crc_errors = 0;
+	state->resyncs = 0;
+	state->discarded = 0;
+	state->duplicates = 0;
+	set_state(state, SEEKING_START_BYTE, 1, 0);
+}
+
+/*
+ * Drops the packet currently being received, along with
+ * another 'discarded' bytes of input the caller has thrown away,
+ * and starts hunting for the start byte of the next packet.
+ */
+void lunix_protocol_resync(struct lunix_protocol_state_struct *state, int discarded)
 {
+	debug("resyncing, dropping %d bytes of packet data\n", state->pos);
+	state->resyncs++;
+	state->discarded += state->pos + discarded;
 	state->pos = 0;
 	state->next_is_special = 0;
 	set_state(state, SEEKING_START_BYTE, 1, 0);
 }
 
+/*
+ * Skips everything up to the next start byte.
+ * Returns the number of bytes skipped.
+ */
+static int lunix_protocol_hunt(struct lunix_protocol_state_struct *state,
+	const unsigned char *data, int length)
+{
+	const unsigned char *p;
+	int skipped;
+
+	p = memchr(data, 0x7E, length);
+	skipped = p ? p - data : length;
+	state->discarded += skipped;
+
+	return skipped;
+}
+
+/*
+ * Returns the length of the longest prefix of data[0..len)
+ * which does not contain any of the special (0x7E, 0x7D) bytes.
+ */
+static inline int lunix_protocol_escape_free_run(const unsigned char *data, int len)
+{
+	int n;
+
+	for (n = 0; n < len; n++)
+		if (data[n] == 0x7E || data[n] == 0x7D)
+			break;
+	return n;
+}
+
 /*
  * Crucial function for parsing the input packet according
  * to the current state.
  *
+ * Instead of stepping through the input one byte at a time,
+ * escape-free runs of bytes are copied into the packet buffer in bulk.
+ * Only the special characters and the byte following them are handled
+ * one by one. An unescaped start byte in the middle of a packet means
+ * we have lost sync with the input stream; it is left in place and
+ * -1 is returned, so that the caller can start over from it.
+ *
  * struct lunix_protocol_state_struct *state: 
  * unsigned char *data: the data received
  * int length: the amount of bytes received
@@ -133,135 +240,174 @@ void lunix_protocol_init(struct lunix_protocol_state_struct *state)
 static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 	const unsigned char *data, int length, int *i, int use_specials)
 {
-	int iter;
-
-	//debug("entering, for *i = %d, length = %d, state = %d, btr = %d, br = %d, next_is_special = %d\n",
-	//	*i, length, state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
+	int run;
 
-	iter = 0;
 	while ((*i < length) && (state->bytes_read < state->bytes_to_read))
 	{
-#if LUNIX_DEBUG
-		if (++iter == 50) {
-			debug("OOPS!\n");
-			return -1;
-		}
-#endif
 		/* Prevent buffer overflows */
 		if (state->pos == MAX_PACKET_LEN) {
-			printk(KERN_ERR "WARNING: state->pos == %d, MAX_PACKET_LEN is %d,"
-				"packet buffer would overflow!\n", state->pos, MAX_PACKET_LEN);
-			printk(KERN_ERR "How will I ever resync with the input stream?\n");
-			state->pos = 0;
+			debug("state->pos == %d, packet buffer would overflow\n",
+				state->pos);
 			return -1;
 		}
 
-		if (1 == use_specials)
-		{
-			if (state->next_is_special)
-			{
-				if (0x7E == state->next_is_special)
-					state->packet[state->pos] = data[*i];
-				if (0x7D == state->next_is_special)
-					state->packet[state->pos] = data[*i]^0x20;
-				++state->pos;
-				++state->bytes_read;
-				++(*i);
-				state->next_is_special = 0;
-			}
-			else
-			{
-				if ((0x7E == data[*i]) || (0x7D == data[*i]))
-				{
-					state->next_is_special = data[*i];
-					++(*i);
-				} else {
-					state->packet[state->pos] = data[*i];
-					++state->pos;
-					++state->bytes_read;
-					++(*i);
-				}
-			}
-		}
-		else
-		{
-			state->packet[state->pos] = data[*i];
+		if (use_specials && 0x7E == data[*i])
+			return -1;
+
+		if (use_specials && state->next_is_special) {
+			state->packet[state->pos] = data[*i]^0x20;
+			if (lunix_protocol_crc_covers(state->state))
+				state->crc = lunix_protocol_crc_update(state->crc,
+					&state->packet[state->pos], 1);
 			++state->pos;
 			++state->bytes_read;
 			++(*i);
+			state->next_is_special = 0;
+			continue;
 		}
+
+		/*
+		 * Copy as much as we can in one go: bounded by the input,
+		 * by what the current state still expects and by the room
+		 * left in the packet buffer.
+		 */
+		run = min3(length - *i, state->bytes_to_read - state->bytes_read,
+			MAX_PACKET_LEN - state->pos);
+		if (use_specials) {
+			run = lunix_protocol_escape_free_run(&data[*i], run);
+			if (run == 0) {
+				state->next_is_special = data[*i];
+				++(*i);
+				continue;
+			}
+		}
+		memcpy(&state->packet[state->pos], &data[*i], run);
+		if (lunix_protocol_crc_covers(state->state))
+			state->crc = lunix_protocol_crc_update(state->crc, &data[*i], run);
+		state->pos += run;
+		state->bytes_read += run;
+		*i += run;
 	}
 
-	if (state->bytes_read == state->bytes_to_read) {
-		//debug("returning 1 from state = %d, btr = %d, br = %d, next_is_special = %d\n",
-		//	state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
+	if (state->bytes_read == state->bytes_to_read)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Advances the state machine once the current state has read
+ * all the bytes it expects. Returns 1 if a complete XMesh packet
+ * has been received, 0 otherwise.
+ */
+static int lunix_protocol_next_state(struct lunix_protocol_state_struct *state)
+{
+	switch (state->state) {
+	case SEEKING_START_BYTE:
+		state->crc = 0;
+		set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+		break;
+	case SEEKING_PACKET_TYPE:
+		set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
+		break;
+	case SEEKING_DESTINATION_ADDRESS:
+		set_state(state, SEEKING_AM_TYPE, 1, 0);
+		break;
+	case SEEKING_AM_TYPE:
+		set_state(state, SEEKING_AM_GROUP, 1, 0);
+		break;
+	case SEEKING_AM_GROUP:
+		set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
+		break;
+	case SEEKING_PAYLOAD_LENGTH:
+		set_state(state, SEEKING_PAYLOAD, state->packet[state->pos - 1], 0);
+		break;
+	case SEEKING_PAYLOAD:
+		set_state(state, SEEKING_CRC, 2, 0);
+		break;
+	case SEEKING_CRC:
+		set_state(state, SEEKING_END_BYTE, 1, 0);
+		break;
+	case SEEKING_END_BYTE:
 		return 1;
-	}	
+	}
 
-	//debug("returning 0 from state = %d, btr = %d, br = %d, next_is_special = %d\n",
-	//	state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
 	return 0;
 }
 
+/*
+ * Only the start, packet type and end bytes are
+ * received without special character processing.
+ */
+static inline int lunix_protocol_uses_specials(int state)
+{
+	return state != SEEKING_START_BYTE &&
+	       state != SEEKING_PACKET_TYPE &&
+	       state != SEEKING_END_BYTE;
+}
+
 /*
  * This function gets called for incoming data
- * to update the protocol state machine.
+ * to update the protocol state machine. The whole buffer is
+ * consumed, so it may contain any number of XMesh packets.
+ *
+ * Returns the number of complete packets with a valid CRC received.
  */
 
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
 	const unsigned char *buf, int length)
 {
 	int i;
-	int payload_length;
+	int ret;
+	int packets;
 
 	i = 0;
-
-	if (state->state == SEEKING_START_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_PACKET_TYPE, 1, 0);
-
-
-	if (state->state == SEEKING_PACKET_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
-
-	if (state->state == SEEKING_DESTINATION_ADDRESS) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_TYPE, 1, 0);
-
-	if (state->state == SEEKING_AM_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_GROUP, 1, 0);
-
-	if (state->state == SEEKING_AM_GROUP) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
-
-	if (state->state == SEEKING_PAYLOAD_LENGTH) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
-			payload_length = state->packet[state->pos - 1];
-			set_state(state, SEEKING_PAYLOAD, payload_length, 0);
+	packets = 0;
+	for (;;) {
+		/*
+		 * Skip any garbage in front of the next packet. Back-to-back
+		 * start bytes (e.g. the end byte of the previous packet
+		 * followed by the start byte of this one) collapse into one.
+		 */
+		if (state->state == SEEKING_START_BYTE)
+			i += lunix_protocol_hunt(state, &buf[i], length - i);
+		else if (state->state == SEEKING_PACKET_TYPE)
+			while (i < length && 0x7E == buf[i])
+				i++;
+
+		ret = lunix_protocol_parse_state(state, buf, length, &i,
+			lunix_protocol_uses_specials(state->state));
+		if (ret < 0) {
+			lunix_protocol_resync(state, 0);
+			continue;
 		}
+		if (ret == 0)
+			break;
 
-	if (state->state == SEEKING_PAYLOAD) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_CRC, 2, 0);
-
-	if (state->state == SEEKING_CRC) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_END_BYTE, 1, 0);
-
-	if (state->state == SEEKING_END_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
-			//debug("An XMesh packet has been received, updating sensors\n");
-
-			lunix_protocol_update_sensors(state, lunix_sensors);
+		if (lunix_protocol_next_state(state)) {
+			if (0x7E != state->packet[state->pos - 1]) {
+				lunix_protocol_resync(state, 0);
+				continue;
+			}
+			/*
+			 * Corrupted packets never make it
+			 * to the sensor buffers.
+			 */
+			if (lunix_protocol_crc_ok(state)) {
+				//debug("An XMesh packet has been received, updating sensors\n");
+				lunix_protocol_update_sensors(state);
+				packets++;
+			} else {
+				debug("dropping packet with bad CRC 0x%04x\n", state->crc);
+				state->crc_errors++;
+			}
 			state->pos = 0;
 			state->next_is_special = 0;
 			set_state(state, SEEKING_START_BYTE, 1, 0);
 		}
+	}
 
-	//debug("leaving\n");
+	//debug("leaving, %d packets received\n", packets);
 
-	return 0;
+	return packets;
 }
@@ -47,17 +47,24 @@ struct lunix_protocol_state_struct
 	int bytes_read;	
 	int bytes_to_read;
 
+	int line;                       /* The line packets are received on, see lunix_sensor_update() */
 	int pos;                        /* Current pos in the XMesh Packet */
 	unsigned char next_is_special;  /* The next character to be received is a special character */
 	unsigned char payload_length;   /* The length of the payload of the received packet */
+	uint16_t crc;                   /* Running CRC of the packet received so far */
+	unsigned long crc_errors;       /* Number of packets dropped due to a bad CRC */
+	unsigned long resyncs;          /* Number of times we lost sync with the input stream */
+	unsigned long discarded;        /* Number of bytes thrown away while resyncing */
+	unsigned long duplicates;       /* Number of packets already received on another line */
 	unsigned char packet[MAX_PACKET_LEN]; /* The XMesh packet being received */
 };
 
 /*
  * Function prototypes
  */
-void lunix_protocol_init(struct lunix_protocol_state_struct *);
+void lunix_protocol_init(struct lunix_protocol_state_struct *, int line);
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *, const unsigned char *buf, int count);
+void lunix_protocol_resync(struct lunix_protocol_state_struct *, int discarded);
 
 #endif	/* __KERNEL__ */
 
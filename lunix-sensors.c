@@ -17,80 +17,458 @@
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
 #include <linux/vmalloc.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/radix-tree.h>
+#include <linux/workqueue.h>
 
 #include "lunix.h"
+#include "lunix-chrdev.h"
+#include "lunix-lookup.h"
+
+/*
+ * Sensors live in a sparse table indexed by node id, and are only
+ * created once a node is first heard from.
+ * Lookups are lockless under RCU; insertions serialize on
+ * lunix_sensor_tree_lock. Sensors are never removed while the
+ * module is loaded.
+ */
+static RADIX_TREE(lunix_sensor_tree, GFP_ATOMIC);
+static DEFINE_SPINLOCK(lunix_sensor_tree_lock);
+static struct kmem_cache *lunix_sensor_cache;
 
 /*
  * Initialization and destruction of sensor structures
  */
-int lunix_sensor_init(struct lunix_sensor_struct *s)
+static void lunix_sensor_init(struct lunix_sensor_struct *s, uint16_t nodeid)
 {
 	int i;
-	int ret;
-	unsigned long p;
 
-	/*
-	 * Initialize structure fields
-	 */
-	spin_lock_init(&s->lock);
-	init_waitqueue_head(&s->wq);
-
-	/*
-	 * Allocate one page per measurement buffer
-	 */
+	s->nodeid = nodeid;
+	seqlock_init(&s->lock);
 	for (i = 0; i < N_LUNIX_MSR; i++)
-		s->msr_data[i] = NULL;
+		init_waitqueue_head(&s->wq[i]);
+	s->last_line = -1;
+}
+
+static void lunix_sensor_destroy(struct lunix_sensor_struct *s)
+{
+	int i;
 
 	for (i = 0; i < N_LUNIX_MSR; i++) {
-		p = get_zeroed_page(GFP_KERNEL);
+		if (s->msr_data[i])
+			free_page((unsigned long)s->msr_data[i]);
+	}
+	kfree(s->stats);
+	kmem_cache_free(lunix_sensor_cache, s);
+}
+
+/*
+ * Allocates a sensor structure and its rolling statistics, along
+ * with one page per measurement buffer, unless sensors are kept compact.
+ */
+static struct lunix_sensor_struct *lunix_sensor_alloc(gfp_t gfp)
+{
+	int i;
+	unsigned long p;
+	struct lunix_sensor_struct *s;
+
+	s = kmem_cache_zalloc(lunix_sensor_cache, gfp);
+	if (!s)
+		return NULL;
+	s->stats = kzalloc(sizeof(*s->stats), gfp);
+	if (!s->stats) {
+		lunix_sensor_destroy(s);
+		return NULL;
+	}
+	if (lunix_sensor_compact)
+		return s;
+
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		p = get_zeroed_page(gfp);
 		if (!p) {
-			ret = -ENOMEM;
-			goto out;
+			lunix_sensor_destroy(s);
+			return NULL;
 		}
 		s->msr_data[i] = (struct lunix_msr_data_struct *)p;
 		s->msr_data[i]->magic = LUNIX_MSR_MAGIC;
+		s->msr_data[i]->version = LUNIX_MSR_VERSION;
 	}
 
-	ret = 0;
-out:
-	return ret;
+	return s;
 }
 
-void lunix_sensor_destroy(struct lunix_sensor_struct *s)
+/*
+ * The first packet from a node arrives in atomic context, so sensors
+ * created from the receive path are taken ready-made from a small
+ * pool, which is refilled from process context. Callers which may
+ * sleep allocate sensors directly.
+ */
+static struct lunix_sensor_struct *lunix_sensor_pool[LUNIX_SENSOR_POOL_SIZE];
+static int lunix_sensor_pool_cnt;
+static DEFINE_SPINLOCK(lunix_sensor_pool_lock);
+
+static void lunix_sensor_pool_refill(struct work_struct *work)
+{
+	unsigned long flags;
+	struct lunix_sensor_struct *s;
+
+	while (READ_ONCE(lunix_sensor_pool_cnt) < LUNIX_SENSOR_POOL_SIZE) {
+		s = lunix_sensor_alloc(GFP_KERNEL);
+		if (!s)
+			break;
+
+		spin_lock_irqsave(&lunix_sensor_pool_lock, flags);
+		if (lunix_sensor_pool_cnt < LUNIX_SENSOR_POOL_SIZE) {
+			lunix_sensor_pool[lunix_sensor_pool_cnt++] = s;
+			s = NULL;
+		}
+		spin_unlock_irqrestore(&lunix_sensor_pool_lock, flags);
+
+		/* Raced with lunix_sensor_pool_put() */
+		if (s)
+			lunix_sensor_destroy(s);
+	}
+}
+static DECLARE_WORK(lunix_sensor_pool_work, lunix_sensor_pool_refill);
+
+static struct lunix_sensor_struct *lunix_sensor_pool_get(void)
+{
+	unsigned long flags;
+	struct lunix_sensor_struct *s = NULL;
+
+	spin_lock_irqsave(&lunix_sensor_pool_lock, flags);
+	if (lunix_sensor_pool_cnt > 0)
+		s = lunix_sensor_pool[--lunix_sensor_pool_cnt];
+	spin_unlock_irqrestore(&lunix_sensor_pool_lock, flags);
+
+	schedule_work(&lunix_sensor_pool_work);
+	return s;
+}
+
+/*
+ * Returns an unused sensor to the pool, if there is room for it.
+ */
+static void lunix_sensor_pool_put(struct lunix_sensor_struct *s)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lunix_sensor_pool_lock, flags);
+	if (lunix_sensor_pool_cnt < LUNIX_SENSOR_POOL_SIZE) {
+		lunix_sensor_pool[lunix_sensor_pool_cnt++] = s;
+		s = NULL;
+	}
+	spin_unlock_irqrestore(&lunix_sensor_pool_lock, flags);
+
+	if (s)
+		lunix_sensor_destroy(s);
+}
+
+/*
+ * Returns the sensor with the given node id,
+ * or NULL if it has not been created yet.
+ */
+struct lunix_sensor_struct *lunix_sensor_lookup(uint16_t nodeid)
+{
+	struct lunix_sensor_struct *s;
+
+	rcu_read_lock();
+	s = radix_tree_lookup(&lunix_sensor_tree, nodeid);
+	rcu_read_unlock();
+
+	return s;
+}
+
+/*
+ * Fills batch with up to n sensors, in order of node id, starting
+ * from the given one. Returns the number of sensors found.
+ */
+unsigned int lunix_sensors_lookup(struct lunix_sensor_struct **batch,
+	unsigned long first, unsigned int n)
+{
+	rcu_read_lock();
+	n = radix_tree_gang_lookup(&lunix_sensor_tree, (void **)batch, first, n);
+	rcu_read_unlock();
+
+	return n;
+}
+
+/*
+ * Returns the sensor with the given node id, creating it if this
+ * is the first time we hear about it. Returns NULL if the node id
+ * is out of range, or if we are out of memory.
+ */
+struct lunix_sensor_struct *lunix_sensor_get(uint16_t nodeid, gfp_t gfp)
+{
+	int ret;
+	int preloaded;
+	struct lunix_sensor_struct *s;
+
+	s = lunix_sensor_lookup(nodeid);
+	if (likely(s))
+		return s;
+
+	if (nodeid == 0 || nodeid > lunix_sensor_cnt)
+		return NULL;
+
+	/*
+	 * Callers which may sleep allocate the sensor and preallocate
+	 * the tree nodes they need, everyone else uses the pool and
+	 * falls back to GFP_ATOMIC for the tree nodes.
+	 */
+	preloaded = gfpflags_allow_blocking(gfp);
+	s = preloaded ? lunix_sensor_alloc(gfp) : lunix_sensor_pool_get();
+	if (!s)
+		return NULL;
+	lunix_sensor_init(s, nodeid);
+
+	if (preloaded && radix_tree_preload(gfp) < 0)
+		goto out_with_sensor;
+	spin_lock(&lunix_sensor_tree_lock);
+	ret = radix_tree_insert(&lunix_sensor_tree, nodeid, s);
+	spin_unlock(&lunix_sensor_tree_lock);
+	if (preloaded)
+		radix_tree_preload_end();
+
+	/* Someone else got there first */
+	if (ret == -EEXIST) {
+		lunix_sensor_pool_put(s);
+		return lunix_sensor_lookup(nodeid);
+	}
+	if (ret < 0)
+		goto out_with_sensor;
+
+	debug("created sensor for node id %d\n", nodeid);
+	lunix_chrdev_sensor_created(s);
+	return s;
+
+out_with_sensor:
+	lunix_sensor_pool_put(s);
+	return NULL;
+}
+
+/*
+ * Creates the sensor cache and fills the pool of sensors
+ * for the receive path, at module load time
+ */
+int lunix_sensors_init(void)
+{
+	lunix_sensor_cache = kmem_cache_create("lunix_sensor",
+		sizeof(struct lunix_sensor_struct), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!lunix_sensor_cache)
+		return -ENOMEM;
+
+	lunix_sensor_pool_refill(NULL);
+	if (lunix_sensor_pool_cnt == 0) {
+		kmem_cache_destroy(lunix_sensor_cache);
+		lunix_sensor_cache = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Destroys all sensors, at module unload time
+ */
+void lunix_sensors_destroy(void)
+{
+	unsigned int i, n;
+	struct lunix_sensor_struct *batch[16];
+
+	while ((n = radix_tree_gang_lookup(&lunix_sensor_tree, (void **)batch,
+			0, ARRAY_SIZE(batch))) > 0) {
+		for (i = 0; i < n; i++) {
+			radix_tree_delete(&lunix_sensor_tree, batch[i]->nodeid);
+			lunix_sensor_destroy(batch[i]);
+		}
+	}
+
+	cancel_work_sync(&lunix_sensor_pool_work);
+	while (lunix_sensor_pool_cnt > 0)
+		lunix_sensor_destroy(lunix_sensor_pool[--lunix_sensor_pool_cnt]);
+
+	kmem_cache_destroy(lunix_sensor_cache);
+	lunix_sensor_cache = NULL;
+}
+
+/*
+ * Appends a new sample to the history of a measurement,
+ * overwriting the oldest one. Must be called with the sensor lock held.
+ * The page may be mapped to userspace, so updates are also published
+ * under the lock count in the page itself.
+ */
+static void lunix_msr_push(struct lunix_msr_data_struct *msr,
+	enum lunix_msr_enum type, uint64_t now, uint32_t value)
+{
+	struct lunix_msr_sample_struct *sample;
+
+	WRITE_ONCE(msr->lock, msr->lock + 1);
+	smp_wmb();
+
+	msr->head = (msr->head + 1) & (LUNIX_MSR_HISTORY - 1);
+	sample = &msr->values[msr->head];
+	sample->seq = ++msr->seq;
+	sample->timestamp = now;
+	sample->value = value;
+	sample->cooked = lunix_sensor_cook(type, value);
+	msr->last_update = now;
+
+	smp_wmb();
+	WRITE_ONCE(msr->lock, msr->lock + 1);
+}
+
+/*
+ * Converts a raw measurement to thousandths of the relevant unit.
+ * Temperature and battery voltage come from tables covering the range
+ * of the ADC; temperatures at or past its full scale are as useless
+ * as at full scale itself, voltages past it follow the same curve.
+ */
+long lunix_sensor_cook(enum lunix_msr_enum type, uint32_t raw)
+{
+	switch (type) {
+	case BATT:
+		if (likely(raw < LUNIX_LOOKUP_SIZE))
+			return lookup_voltage[raw];
+		return LUNIX_LOOKUP_VOLTAGE_SCALE / raw;
+	case TEMP:
+		return lookup_temperature[min_t(uint32_t, raw, LUNIX_LOOKUP_SIZE - 1)];
+	case LIGHT:
+		return div_u64(raw * LUNIX_LOOKUP_LIGHT_SCALE, LUNIX_LOOKUP_LIGHT_FS);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The bucket of the rolling statistics the current time falls in.
+ * Uses the monotonic clock, so that setting the wall clock neither
+ * recycles live buckets nor revives stale ones.
+ */
+uint64_t lunix_stats_epoch(void)
+{
+	return div64_u64(ktime_to_ns(ktime_get()),
+		(uint64_t)lunix_stats_bucket_ms * NSEC_PER_MSEC);
+}
+
+/*
+ * Adds a new set of measurements to the rolling statistics.
+ * Must be called with the sensor lock held.
+ */
+static void lunix_stats_update(struct lunix_sensor_stats_struct *stats,
+	const uint32_t *values)
 {
 	int i;
+	long v;
+	uint64_t epoch, idx;
+	struct lunix_stats_bucket_struct *b;
+
+	epoch = lunix_stats_epoch();
+	idx = epoch;
+	b = &stats->buckets[do_div(idx, LUNIX_STATS_BUCKETS)];
+
+	/* Recycle the bucket, if it was last used a full ring ago */
+	if (b->epoch != epoch) {
+		b->epoch = epoch;
+		b->count = 0;
+	}
 
 	for (i = 0; i < N_LUNIX_MSR; i++) {
-		if (s->msr_data[i])
-			free_page((unsigned long)s->msr_data[i]);
+		v = lunix_sensor_cook(i, values[i]);
+		if (b->count == 0) {
+			b->min[i] = b->max[i] = v;
+			b->sum[i] = 0;
+		}
+		b->min[i] = min_t(long, b->min[i], v);
+		b->max[i] = max_t(long, b->max[i], v);
+		b->sum[i] += v;
+
+		if (stats->samples == 0)
+			stats->ewma[i] = v;
+		else
+			stats->ewma[i] += (v - stats->ewma[i]) / (1 << LUNIX_STATS_EWMA_SHIFT);
 	}
+	b->count++;
+	stats->samples++;
 }
 
-void lunix_sensor_update(struct lunix_sensor_struct *s,
+/*
+ * Measurements received by more than one gateway show up on
+ * different lines within a short time of each other.
+ * Must be called with the sensor lock held.
+ */
+static int lunix_sensor_is_duplicate(struct lunix_sensor_struct *s, int line,
+	uint64_t seen, uint16_t batt, uint16_t temp, uint16_t light)
+{
+	return line != s->last_line &&
+	       seen - s->last_seen <
+			(uint64_t)lunix_dedup_window_ms * NSEC_PER_MSEC &&
+	       s->values[BATT] == batt &&
+	       s->values[TEMP] == temp &&
+	       s->values[LIGHT] == light;
+}
+
+/*
+ * Publishes a new set of measurements for a sensor, received on a
+ * specific line. Returns -EEXIST if the measurements were dropped as
+ * a duplicate of the ones just received on another line, 0 otherwise.
+ */
+int lunix_sensor_update(struct lunix_sensor_struct *s, int line,
 	uint16_t batt, uint16_t temp, uint16_t light)
 {
-	spin_lock(&s->lock);
-	
+	int i;
+	uint64_t now, seen;
+
 	/*
-	 * Update the raw values and the relevant timestamps.
+	 * Take the timestamps under the lock, so that updates racing
+	 * in from different lines are stamped in the order they are
+	 * applied. Duplicates are timed on the monotonic clock, while
+	 * readers get the wall clock time of the update.
 	 */
-	s->msr_data[BATT]->values[0] = batt;
-	s->msr_data[TEMP]->values[0] = temp;
-	s->msr_data[LIGHT]->values[0] = light;
+	write_seqlock(&s->lock);
+	seen = ktime_to_ns(ktime_get());
+	now = ktime_to_ns(ktime_get_real());
 
-	s->msr_data[BATT]->magic = s->msr_data[TEMP]->magic = s->msr_data[LIGHT]->magic = LUNIX_MSR_MAGIC;
-	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = get_seconds();
-	
-	spin_unlock(&s->lock);
+	if (lunix_sensor_is_duplicate(s, line, seen, batt, temp, light)) {
+		write_sequnlock(&s->lock);
+		return -EEXIST;
+	}
+	s->last_line = line;
+	s->last_seen = seen;
 
 	/*
-	 * And wake up any sleepers who may be waiting on
-	 * fresh data from this sensor.
+	 * Store the raw values, along with the relevant timestamp and
+	 * sequence number, and append them to the history of each
+	 * measurement. Readers see either all three of them, or none.
 	 */
-	wake_up_interruptible(&s->wq);
+	s->seq++;
+	s->last_update = now;
+	s->values[BATT] = batt;
+	s->values[TEMP] = temp;
+	s->values[LIGHT] = light;
+
+	if (s->msr_data[BATT]) {
+		lunix_msr_push(s->msr_data[BATT], BATT, now, batt);
+		lunix_msr_push(s->msr_data[TEMP], TEMP, now, temp);
+		lunix_msr_push(s->msr_data[LIGHT], LIGHT, now, light);
+	}
+	lunix_stats_update(s->stats, s->values);
+
+	write_sequnlock(&s->lock);
+
+	/*
+	 * And wake up any sleepers who may be waiting on fresh data
+	 * for each measurement. Most measurements of most sensors have
+	 * nobody waiting on them, so skip taking the wait queue lock.
+	 */
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		if (wq_has_sleeper(&s->wq[i]))
+			wake_up_interruptible(&s->wq[i]);
+
+	return 0;
 }
@@ -19,10 +19,20 @@
 #include <linux/tty.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/llist.h>
+#include <linux/seqlock.h>
 
 /*
- * A structure representing a hardware sensor
- * and pages holding the most recent measurements received
+ * A structure representing a hardware sensor, the most recent
+ * measurements received and, optionally, pages holding their history.
+ *
+ * Sensors come from a cache of cacheline-aligned objects, so they never
+ * share cachelines with each other. The fields the writer stores to on
+ * every update live on the first cacheline. The wait queues follow,
+ * their locks taken by sleeping readers and by wakeups, along with the
+ * fields only written at creation or once afterwards. The claims of
+ * exclusive readers, written on every read, get a cacheline of their
+ * own so they never bounce the others.
  */
 
 #define LUNIX_MSR_MAGIC 0xF00DF00D
@@ -30,31 +40,118 @@
 enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
 struct lunix_sensor_struct {
 	/*
-	 * A number of pages, one for each measurement.
-	 * They can be mapped to userspace.
+	 * Seqlock used to publish new measurements. Writers on the
+	 * serial line discipline side serialize on its spinlock, while
+	 * readers on the character device side never write to it: they
+	 * copy the measurements and retry if an update raced with them.
+	 */
+	seqlock_t lock ____cacheline_aligned_in_smp;
+
+	/*
+	 * The most recent measurements, the number of updates so far
+	 * and the time of the last update, in ns since the Epoch.
+	 */
+	uint64_t seq;
+	uint64_t last_update;
+	uint32_t values[N_LUNIX_MSR];
+
+	/*
+	 * The line the last update was received on and when, in ns on
+	 * the monotonic clock, used to suppress duplicates heard by more
+	 * than one gateway regardless of changes to the wall clock
+	 */
+	int last_line;
+	uint64_t last_seen;
+
+	uint16_t nodeid ____cacheline_aligned_in_smp;
+
+	/*
+	 * A number of pages, one for each measurement, holding its
+	 * recent history. They can be mapped to userspace.
+	 * NULL if sensors are kept compact.
 	 */
 	struct lunix_msr_data_struct *msr_data[N_LUNIX_MSR];
 
 	/*
-	 * Spinlock used to assert mutual exclusion between
-	 * the serial line discipline and the character device driver
+	 * Lists of processes waiting to be woken up when
+	 * this sensor has new data, one per measurement
 	 */
-	spinlock_t lock;
+	wait_queue_head_t wq[N_LUNIX_MSR];
 
 	/*
-	 * A list of processes waiting to be woken up
-	 * when this sensor has been updated with new data
+	 * Rolling statistics, kept from the first update on
 	 */
-	wait_queue_head_t wq;
+	struct lunix_sensor_stats_struct *stats;
+
+	/*
+	 * Queued for its device nodes to be created,
+	 * set once they have been
+	 */
+	struct llist_node devices_node;
+	int has_devices;
+
+	/*
+	 * The most recent update claimed by a reader
+	 * in exclusive mode, one per measurement
+	 */
+	atomic64_t claimed[N_LUNIX_MSR] ____cacheline_aligned_in_smp;
 };
 
 /*
- * The default value for the maximum number of sensors supported
+ * Rolling statistics of the measurements of a sensor, in thousandths
+ * of the relevant unit. Samples are aggregated in a ring of buckets,
+ * each one covering lunix_stats_bucket_ms milliseconds, so any window
+ * up to LUNIX_STATS_BUCKETS buckets long can be summarized without
+ * walking individual samples. Updated under the sensor seqlock.
+ */
+#define LUNIX_STATS_BUCKETS			60
+#define LUNIX_STATS_BUCKET_MS			1000
+#define LUNIX_STATS_EWMA_SHIFT			3	/* alpha = 1/8 */
+extern int lunix_stats_bucket_ms;
+
+struct lunix_stats_bucket_struct {
+	uint64_t epoch;		/* Time since boot, in buckets */
+	uint32_t count;
+	int32_t min[N_LUNIX_MSR];
+	int32_t max[N_LUNIX_MSR];
+	int64_t sum[N_LUNIX_MSR];
+};
+
+struct lunix_sensor_stats_struct {
+	uint64_t samples;
+	int64_t ewma[N_LUNIX_MSR];
+	struct lunix_stats_bucket_struct buckets[LUNIX_STATS_BUCKETS];
+};
+
+/*
+ * The default value for the maximum number of sensors supported,
+ * i.e. the highest node id accepted, which also sizes the range of
+ * minor numbers. Sensors are only allocated for the nodes actually
+ * heard from, so it can be raised up to the whole 16-bit node id
+ * space at no cost beyond the minor numbers.
  */
 #define LUNIX_SENSOR_CNT			16
+#define LUNIX_SENSOR_MAX			65535
 extern int lunix_sensor_cnt;
-extern struct lunix_sensor_struct *lunix_sensors;
-extern struct lunix_protocol_state_struct lunix_protocol_state;
+
+/*
+ * Number of sensors kept preallocated for nodes
+ * heard from for the first time.
+ */
+#define LUNIX_SENSOR_POOL_SIZE			4
+
+/*
+ * Whether to keep only the most recent measurements of each sensor,
+ * without the per-measurement history pages.
+ */
+extern int lunix_sensor_compact;
+
+/*
+ * Identical measurements from the same sensor, received on different
+ * lines within this many milliseconds, are considered duplicates.
+ */
+#define LUNIX_DEDUP_WINDOW_MS			250
+extern int lunix_dedup_window_ms;
 
 /*
  * Debugging
@@ -69,23 +166,67 @@ extern struct lunix_protocol_state_struct lunix_protocol_state;
 /*
  * Function prototypes
  */
-int lunix_sensor_init(struct lunix_sensor_struct *);
-void lunix_sensor_destroy(struct lunix_sensor_struct *);
-void lunix_sensor_update(struct lunix_sensor_struct *s,
+struct lunix_sensor_struct *lunix_sensor_lookup(uint16_t nodeid);
+unsigned int lunix_sensors_lookup(struct lunix_sensor_struct **batch,
+	unsigned long first, unsigned int n);
+struct lunix_sensor_struct *lunix_sensor_get(uint16_t nodeid, gfp_t gfp);
+int lunix_sensors_init(void);
+void lunix_sensors_destroy(void);
+int lunix_sensor_update(struct lunix_sensor_struct *s, int line,
 	uint16_t batt, uint16_t temp, uint16_t light);
+long lunix_sensor_cook(enum lunix_msr_enum type, uint32_t raw);
+uint64_t lunix_stats_epoch(void);
 
 #else
 #include <inttypes.h>
 #endif	/* __KERNEL__ */
+/*
+ * A single measurement, raw and converted to thousandths of the
+ * relevant unit, along with its sequence number and the time
+ * it was received, in ns since the Epoch.
+ */
+struct lunix_msr_sample_struct {
+	uint64_t seq;
+	uint64_t timestamp;
+	uint32_t value;
+	int32_t cooked;
+};
+
 /*
  * A structure, living at the start of a page, containing a version number
- * [timestamp of last update] and a variable number of 32-bit quantities. It is
- * meant to be mappable to userspace.
+ * [sequence number and timestamp of last update] and a ring of the last
+ * LUNIX_MSR_HISTORY samples received. The page of each measurement can be
+ * mapped read-only to userspace, through its device node.
+ *
+ * The most recent sample lives in values[head], the one before it in
+ * values[head - 1] and so on, modulo LUNIX_MSR_HISTORY. Only the last
+ * min(seq, LUNIX_MSR_HISTORY) samples are valid.
+ *
+ * 'lock' is odd while the page is being updated. Readers of a mapping
+ * get a consistent view of anything in the page by retrying as follows:
+ *
+ *	do {
+ *		while ((start = lock) & 1)
+ *			;
+ *		read barrier;
+ *		copy what is needed;
+ *		read barrier;
+ *	} while (lock != start);
+ *
+ * The layout itself is versioned; anyone interpreting the page
+ * should check for LUNIX_MSR_VERSION first.
  */
+#define LUNIX_MSR_VERSION 4
+#define LUNIX_MSR_HISTORY 128	/* Power of 2, must fit in a page */
+
 struct lunix_msr_data_struct {
 	uint32_t magic;
-	uint32_t last_update;
-	uint32_t values[];
+	uint32_t version;	/* Layout version, LUNIX_MSR_VERSION */
+	uint64_t last_update;	/* Time of last update, in ns since the Epoch */
+	uint64_t seq;		/* Number of updates so far, never wraps */
+	uint32_t head;		/* Index of the most recent sample */
+	uint32_t lock;		/* Odd while an update is in progress */
+	struct lunix_msr_sample_struct values[LUNIX_MSR_HISTORY];
 };
 
 /*
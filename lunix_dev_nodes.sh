@@ -4,9 +4,17 @@
 
 mknod /dev/ttyS0 c 4 64
 
-# Lunix:TNG nodes: 16 sensors, each has 3 nodes.
+# Lunix:TNG nodes: 16 sensors, each has 3 text and 3 binary nodes.
+# Only needed without devtmpfs or udev, which create the nodes of
+# every sensor as it is heard from, along with /dev/lunix-all.
 for sensor in $(seq 0 1 15); do
 	mknod /dev/lunix$sensor-batt c 60 $[$sensor * 8 + 0]
 	mknod /dev/lunix$sensor-temp c 60 $[$sensor * 8 + 1]
 	mknod /dev/lunix$sensor-light c 60 $[$sensor * 8 + 2]
+	mknod /dev/lunix$sensor-batt-bin c 60 $[$sensor * 8 + 4]
+	mknod /dev/lunix$sensor-temp-bin c 60 $[$sensor * 8 + 5]
+	mknod /dev/lunix$sensor-light-bin c 60 $[$sensor * 8 + 6]
 done
+
+# Lunix:TNG snapshot node, for all sensors at once.
+mknod /dev/lunix-all c 60 7
@@ -0,0 +1,80 @@
+/*
+ * mk_crc_tables.c
+ *
+ * Computes the lookup tables used to validate
+ * the CRC-CCITT (polynomial 0x1021, initial value 0)
+ * of incoming XMesh packets, a slice of four input bytes
+ * at a time.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#define CRC_POLY	0x1021
+#define CRC_SLICES	4
+
+static uint16_t crc_table[CRC_SLICES][256];
+
+/*
+ * CRC of a single byte, computed one bit at a time
+ */
+static uint16_t crc_of_byte(uint8_t b)
+{
+	int i;
+	uint16_t crc = b << 8;
+
+	for (i = 0; i < 8; i++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ CRC_POLY : crc << 1;
+
+	return crc;
+}
+
+int main(void)
+{
+	unsigned int i, k;
+
+	/*
+	 * crc_table[0][x] is the CRC of byte x, crc_table[k][x] is the
+	 * CRC of byte x followed by k zero bytes.
+	 */
+	for (i = 0; i < 256; i++)
+		crc_table[0][i] = crc_of_byte(i);
+	for (k = 1; k < CRC_SLICES; k++)
+		for (i = 0; i < 256; i++)
+			crc_table[k][i] = (uint16_t)(crc_table[k - 1][i] << 8) ^
+				crc_table[0][crc_table[k - 1][i] >> 8];
+
+	fprintf(stdout,
+		"/*\n"
+		" * lunix-crc-tables.h\n"
+		" *\n"
+		" * Machine-generated file. DO NOT EDIT.\n"
+		" * See %s instead.\n"
+		" *\n"
+		" * Slice-by-%d lookup tables for the CRC-CCITT\n"
+		" * protecting XMesh packets.\n"
+		" */\n"
+		"\n"
+		"#define LUNIX_CRC_SLICES %d\n"
+		"\n"
+		"static const uint16_t lunix_crc_table[LUNIX_CRC_SLICES][256] = {\n",
+		__FILE__, CRC_SLICES, CRC_SLICES);
+
+	for (k = 0; k < CRC_SLICES; k++) {
+		fprintf(stdout, "\t{\n");
+		for (i = 0; i < 256; i += 8) {
+			fprintf(stdout, "\t\t0x%04x, 0x%04x, 0x%04x, 0x%04x, "
+				"0x%04x, 0x%04x, 0x%04x, 0x%04x",
+				crc_table[k][i], crc_table[k][i+1],
+				crc_table[k][i+2], crc_table[k][i+3],
+				crc_table[k][i+4], crc_table[k][i+5],
+				crc_table[k][i+6], crc_table[k][i+7]);
+			fprintf(stdout, (i != 248) ? ",\n" : "\n");
+		}
+		fprintf(stdout, (k != CRC_SLICES - 1) ? "\t},\n" : "\t}\n");
+	}
+
+	fprintf(stdout, "};\n\n");
+
+	return 0;
+}
@@ -66,60 +66,56 @@ long uint16_to_temp(uint16_t value)
 	return (l < -272150) ?  -272150 : l;
 }
 
-int main(void)
+/*
+ * Raw measurements come from a 10-bit ADC. Temperature and battery
+ * voltage are only tabulated over its range; the kernel handles
+ * anything past it, as well as light, which is a plain linear scale.
+ */
+#define LOOKUP_SIZE	1024
+
+static void print_table(const char *name, long (*conv)(uint16_t))
 {
 	unsigned int i;
 
+	fprintf(stdout, "static const int32_t %s[LUNIX_LOOKUP_SIZE] = {\n", name);
+	for (i = 0; i < LOOKUP_SIZE; i += 4) {
+		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
+			conv(i), conv(i+1), conv(i+2), conv(i+3));
+		fprintf(stdout, (i != LOOKUP_SIZE - 4) ? ",\n" : "\n");
+	}
+	fprintf(stdout, "};\n\n");
+}
+
+int main(void)
+{
 	fprintf(stdout,
 		"/*\n"
-		" * lunix-tables.h\n"
+		" * lunix-lookup.h\n"
 		" *\n"
 		" * Machine-generated file. DO NOT EDIT.\n"
 		" * See %s instead.\n"
 		" *\n"
 		" * Instead of doing floating-point in kernelspace,\n"
-		" * use the following lookup tables to convert 16-bit\n"
-		" * raw measurements to floating point values.\n"
+		" * use the following lookup tables and scale factors\n"
+		" * to convert 16-bit raw measurements to thousandths\n"
+		" * of the relevant unit.\n"
 		" */\n"
-		"\n"
-		"long lookup_temperature[65536] = {\n", __FILE__);
-
-	/*
-	 * Temperature
-	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-			uint16_to_temp(i), uint16_to_temp(i+1),
-			uint16_to_temp(i+2), uint16_to_temp(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
-	}
+		"\n", __FILE__);
 
-	fprintf(stdout, "};\n\n"
-		"long lookup_voltage[65536] = {\n");
-
-	/*
-	 * Battery Voltage
-	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-			uint16_to_batt(i), uint16_to_batt(i+1),
-			uint16_to_batt(i+2), uint16_to_batt(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
-	}
-	fprintf(stdout, "};\n\n"
-		"long lookup_light[65536] = {\n");
-
-	/*
-	 * Light
-	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-			uint16_to_light(i), uint16_to_light(i+1),
-			uint16_to_light(i+2), uint16_to_light(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
-	}
-
-	fprintf(stdout, "};\n\n");
+	fprintf(stdout,
+		"#define LUNIX_LOOKUP_SIZE %d\n"
+		"\n"
+		"/* Battery voltage past the ADC range: SCALE / raw */\n"
+		"#define LUNIX_LOOKUP_VOLTAGE_SCALE %ldUL\n"
+		"\n"
+		"/* Light: raw * SCALE / FS */\n"
+		"#define LUNIX_LOOKUP_LIGHT_SCALE %ldULL\n"
+		"#define LUNIX_LOOKUP_LIGHT_FS %d\n"
+		"\n",
+		LOOKUP_SIZE, lround(1.223 * 1023.0 * 1000), 5000000L, 65535);
+
+	print_table("lookup_temperature", uint16_to_temp);
+	print_table("lookup_voltage", uint16_to_batt);
 
 	return 0;
 }